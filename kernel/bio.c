@@ -1,10 +1,17 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
+// Each hash bucket has its own lock, so lookups of different
+// blocks on different CPUs don't contend. There is no global
+// LRU list; brelse() stamps a buffer with the current tick,
+// and a miss recycles the unused buffer with the oldest stamp.
+// The cache starts with NBUF buffers from bufcache, and gets
+// another only when a miss finds every buffer in use.
+//
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
 // * After changing buffer data, call bwrite to write it to disk.
@@ -22,33 +29,137 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "slab.h"
 
-struct {
-  struct spinlock lock;
-  struct buf buf[NBUF];
+#define NBUCKET 13
+#define BHASH(dev, blockno) ((((uint64)(dev) << 32) | (blockno)) % NBUCKET)
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
+struct bucket {
+  struct spinlock lock;
+  // Linked list of the bucket's buffers, through prev/next.
   struct buf head;
+};
+
+struct {
+  struct bucket bucket[NBUCKET];
 } bcache;
 
+static struct kcache bufcache;
+
+static void
+bufctor(void *o)
+{
+  initsleeplock(&((struct buf*)o)->lock, "buffer");
+}
+
+// Insert b at the front of bucket bk's list.
+// Caller must hold bk->lock.
+static void
+binsert(struct bucket *bk, struct buf *b)
+{
+  b->next = bk->head.next;
+  b->prev = &bk->head;
+  bk->head.next->prev = b;
+  bk->head.next = b;
+}
+
+// Remove b from whatever bucket list it is on.
+// Caller must hold that bucket's lock.
+static void
+bremove(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
 void
 binit(void)
 {
+  struct bucket *bk;
+  struct buf *b;
+
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    initlock(&bk->lock, "bcache");
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
+  }
+  kcache_init(&bufcache, "buf", sizeof(struct buf), bufctor);
+  // Spread the (unused) buffers over the buckets.
+  for(int i = 0; i < NBUF; i++){
+    if((b = kcache_alloc(&bufcache)) == 0)
+      panic("binit");
+    b->dev = 0;
+    b->blockno = 0;
+    b->valid = 0;
+    b->refcnt = 0;
+    b->lastuse = 0;
+    binsert(&bcache.bucket[i % NBUCKET], b);
+  }
+}
+
+// Return the buffer for block (dev, blockno) in bucket bk, or 0.
+// Caller must hold bk->lock.
+static struct buf*
+bfind(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head.next; b != &bk->head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  }
+  return 0;
+}
+
+// Return the least recently used unused buffer in bk, or 0.
+// Caller must hold bk->lock.
+static struct buf*
+blru(struct bucket *bk)
+{
+  struct buf *b, *lru;
+
+  lru = 0;
+  for(b = bk->head.next; b != &bk->head; b = b->next){
+    if(b->refcnt == 0 && (lru == 0 || b->lastuse < lru->lastuse))
+      lru = b;
+  }
+  return lru;
+}
+
+// Take the least recently used unused buffer out of the
+// cache, or return 0 if every buffer is in use.
+// Holds only one bucket lock at a time, so it can't
+// deadlock with other CPUs doing the same; if the chosen
+// bucket's buffer gets used before we lock it again, try again.
+static struct buf*
+bevict(void)
+{
+  struct bucket *bk, *oldest;
   struct buf *b;
+  uint stamp;
 
-  initlock(&bcache.lock, "bcache");
-
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  for(;;){
+    // Find the bucket holding the oldest unused buffer.
+    oldest = 0;
+    stamp = 0;
+    for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+      acquire(&bk->lock);
+      if((b = blru(bk)) != 0 && (oldest == 0 || b->lastuse < stamp)){
+        oldest = bk;
+        stamp = b->lastuse;
+      }
+      release(&bk->lock);
+    }
+    if(oldest == 0)
+      return 0;
+
+    acquire(&oldest->lock);
+    if((b = blru(oldest)) != 0){
+      bremove(b);
+      release(&oldest->lock);
+      return b;
+    }
+    release(&oldest->lock);
   }
 }
 
@@ -58,34 +169,53 @@ binit(void)
 static struct buf*
 bget(uint dev, uint blockno)
 {
-  struct buf *b;
+  struct bucket *bk = &bcache.bucket[BHASH(dev, blockno)];
+  struct buf *b, *victim;
 
-  acquire(&bcache.lock);
+  acquire(&bk->lock);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  if((b = bfind(bk, dev, blockno)) != 0){
+    b->refcnt++;
+    release(&bk->lock);
+    acquiresleep(&b->lock);
+    return b;
   }
+  release(&bk->lock);
 
   // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  // Recycle the least recently used (LRU) unused buffer,
+  // or grow the cache if there is none.
+  if((victim = bevict()) == 0){
+    if((victim = kcache_alloc(&bufcache)) == 0)
+      panic("bget: no buffers");
+    victim->refcnt = 0;
+    victim->lastuse = 0;
+  }
+
+  acquire(&bk->lock);
+  if((b = bfind(bk, dev, blockno)) != 0){
+    // Another process cached the block while we held no
+    // lock. Use its buffer, and park the victim in this
+    // bucket under a block number no one asks for.
+    b->refcnt++;
+    victim->dev = 0;
+    victim->blockno = 0;
+    victim->valid = 0;
+    binsert(bk, victim);
+    release(&bk->lock);
+    acquiresleep(&b->lock);
+    return b;
   }
-  panic("bget: no buffers");
+  b = victim;
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  binsert(bk, b);
+  release(&bk->lock);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -111,43 +241,54 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Write the contents of the n locked buffers in bufs[] to
+// disk, letting the disk work on all of them at once.
+void
+bwritev(struct buf **bufs, int n)
+{
+  for(int i = 0; i < n; i++){
+    if(!holdingsleep(&bufs[i]->lock))
+      panic("bwritev");
+  }
+  virtio_disk_rwv(bufs, n, 1);
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Stamp it with the time of last use for bevict().
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+  acquire(&bk->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->lastuse = ticks;
   }
-  
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
-
-
@@ -5,7 +5,8 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  uint lastuse; // ticks at last brelse(), for LRU eviction
+  struct buf *prev; // hash bucket list
   struct buf *next;
   uchar data[BSIZE];
 };
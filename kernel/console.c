@@ -140,8 +140,10 @@ consoleintr(int c)
   acquire(&cons.lock);
 
   switch(c){
-  case C('P'):  // Print process list.
+  case C('P'):  // Print process list and allocator stats.
     procdump();
+    kmemdump();
+    kcachedump();
     break;
   case C('U'):  // Kill line.
     while(cons.e != cons.w &&
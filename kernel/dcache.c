@@ -0,0 +1,170 @@
+// Directory entry cache.
+//
+// Remembers, for a name in a directory, which i-node it
+// names and at what offset in the directory the entry is,
+// or that the directory has no such entry. dirlookup()
+// consults it before reading the directory, so looking up
+// the same path again needs no directory scans.
+//
+// There are NDENTRY entries, spread over hash buckets by
+// (dev, directory inum, name). Each bucket has its own lock
+// and keeps its entries most recently used first; a new name
+// takes the place of the bucket's least recently used entry.
+//
+// Callers hold the directory's ip->lock, which orders cache
+// updates with changes to the directory itself: dirlink()
+// and sys_unlink() update the cache after each write to a
+// directory, and iput() forgets a directory it frees, before
+// its i-node number can be reused.
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "fs.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "file.h"
+
+#define NDBUCKET 61
+
+struct dentry {
+  uint dev;
+  uint dinum;           // directory's i-node, or 0 if entry unused
+  char name[DIRSIZ];
+  uint inum;            // 0 if the directory has no such name
+  uint off;             // offset of the directory entry
+  struct dentry *prev;  // bucket list, most recently used first
+  struct dentry *next;
+};
+
+struct dbucket {
+  struct spinlock lock;
+  struct dentry head;
+};
+
+struct {
+  struct dbucket bucket[NDBUCKET];
+  struct dentry dentry[NDENTRY];
+} dcache;
+
+static struct dbucket*
+dbucket(uint dev, uint dinum, char *name)
+{
+  uint h = dev * 31 + dinum;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return &dcache.bucket[h % NDBUCKET];
+}
+
+// Move d to the front of bk's list.
+// Caller must hold bk->lock.
+static void
+dfront(struct dbucket *bk, struct dentry *d)
+{
+  d->next->prev = d->prev;
+  d->prev->next = d->next;
+  d->next = bk->head.next;
+  d->prev = &bk->head;
+  bk->head.next->prev = d;
+  bk->head.next = d;
+}
+
+// Return the entry for name in directory dinum, or 0.
+// Caller must hold bk->lock.
+static struct dentry*
+dfind(struct dbucket *bk, uint dev, uint dinum, char *name)
+{
+  struct dentry *d;
+
+  for(d = bk->head.next; d != &bk->head; d = d->next){
+    if(d->dinum == dinum && d->dev == dev && namecmp(d->name, name) == 0)
+      return d;
+  }
+  return 0;
+}
+
+void
+dcacheinit(void)
+{
+  struct dbucket *bk;
+  struct dentry *d;
+
+  for(bk = dcache.bucket; bk < dcache.bucket+NDBUCKET; bk++){
+    initlock(&bk->lock, "dcache");
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
+  }
+  for(d = dcache.dentry; d < dcache.dentry+NDENTRY; d++){
+    bk = &dcache.bucket[(d - dcache.dentry) % NDBUCKET];
+    d->next = bk->head.next;
+    d->prev = &bk->head;
+    bk->head.next->prev = d;
+    bk->head.next = d;
+  }
+}
+
+// Look up name in directory dp. Returns 1 if the cache knows
+// the answer, setting *inum to the i-node number, or to 0 if
+// there is no such entry, and *off to the entry's offset.
+// Returns 0 if dp must be read.
+// Caller must hold dp->lock.
+int
+dcachelookup(struct inode *dp, char *name, uint *inum, uint *off)
+{
+  struct dbucket *bk = dbucket(dp->dev, dp->inum, name);
+  struct dentry *d;
+
+  acquire(&bk->lock);
+  if((d = dfind(bk, dp->dev, dp->inum, name)) == 0){
+    release(&bk->lock);
+    return 0;
+  }
+  dfront(bk, d);
+  *inum = d->inum;
+  *off = d->off;
+  release(&bk->lock);
+  return 1;
+}
+
+// Record that name in directory dp is i-node inum, at offset
+// off, or that there is no such name if inum is 0.
+// Caller must hold dp->lock.
+void
+dcacheenter(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dbucket *bk = dbucket(dp->dev, dp->inum, name);
+  struct dentry *d;
+
+  acquire(&bk->lock);
+  if((d = dfind(bk, dp->dev, dp->inum, name)) == 0){
+    // reuse the least recently used entry.
+    d = bk->head.prev;
+    d->dev = dp->dev;
+    d->dinum = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+  }
+  d->inum = inum;
+  d->off = off;
+  dfront(bk, d);
+  release(&bk->lock);
+}
+
+// Forget all entries of directory dinum on dev, which is
+// being freed.
+void
+dcachepurge(uint dev, uint dinum)
+{
+  struct dbucket *bk;
+  struct dentry *d;
+
+  for(bk = dcache.bucket; bk < dcache.bucket+NDBUCKET; bk++){
+    acquire(&bk->lock);
+    for(d = bk->head.next; d != &bk->head; d = d->next){
+      if(d->dinum == dinum && d->dev == dev)
+        d->dinum = 0;
+    }
+    release(&bk->lock);
+  }
+}
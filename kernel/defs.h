@@ -2,8 +2,11 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kcache;
+struct memstat;
 struct pipe;
 struct proc;
+struct seg;
 struct spinlock;
 struct sleeplock;
 struct stat;
@@ -14,6 +17,7 @@ void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwritev(struct buf**, int);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
 
@@ -22,8 +26,17 @@ void            consoleinit(void);
 void            consoleintr(int);
 void            consputc(int);
 
+// dcache.c
+void            dcacheinit(void);
+void            dcacheenter(struct inode*, char*, uint, uint);
+int             dcachelookup(struct inode*, char*, uint*, uint*);
+void            dcachepurge(uint, uint);
+
 // exec.c
 int             exec(char*, char**);
+struct seg*     execseg(struct proc*, uint64, uint64);
+uint64          execfault(struct proc*, uint64, int);
+int             execprefault(struct proc*, uint64, uint64, int);
 
 // file.c
 struct file*    filealloc(void);
@@ -33,6 +46,7 @@ void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             filesplice(struct file*, struct file*, int n);
 
 // fs.c
 void            fsinit(int);
@@ -52,6 +66,8 @@ struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
+uint64          igetpage(struct inode*, uint);
+void            ipagesfree(struct inode*);
 void            itrunc(struct inode*);
 
 // ramdisk.c
@@ -63,6 +79,18 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void            kmemdump(void);
+void            krefinc(void*);
+int             krefcnt(void*);
+void*           kalloc_pages(int);
+void            kfree_pages(void*, int);
+void            kmemstat(struct memstat*);
+
+// slab.c
+void            kcache_init(struct kcache*, char*, uint, void (*)(void*));
+void*           kcache_alloc(struct kcache*);
+void            kcache_free(struct kcache*, void*);
+void            kcachedump(void);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -70,11 +98,24 @@ void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
 
+// mmap.c
+uint64          mmap(uint64, int, int, struct file*, uint);
+int             munmap(uint64, uint64);
+void            munmapall(struct proc*);
+int             mmapcopy(struct proc*, struct proc*);
+uint64          mmapfault(struct proc*, uint64, int);
+int             mmapprefault(struct proc*, uint64, uint64, int);
+uint64          mmaplow(struct proc*);
+
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
 int             pipewrite(struct pipe*, uint64, int);
+int             pipewbegin(struct pipe*, int, char**);
+void            pipewend(struct pipe*, int);
+int             piperbegin(struct pipe*, int, char**, int);
+void            piperend(struct pipe*, int);
 
 // printf.c
 void            printf(char*, ...);
@@ -139,6 +180,11 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// timer.c
+void            timer_init(void);
+int             timer_sleep(uint64);
+void            timer_intr(void);
+
 // trap.c
 extern uint     ticks;
 void            trapinit(void);
@@ -156,6 +202,8 @@ int             uartgetc(void);
 // vm.c
 void            kvminit(void);
 void            kvminithart(void);
+pte_t*          walk(pagetable_t, uint64, int);
+pte_t*          walklevel(pagetable_t, uint64, int, int*);
 uint64          kvmpa(uint64);
 void            kvmmap(uint64, uint64, uint64, int);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
@@ -164,10 +212,13 @@ void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmshare(pagetable_t, pagetable_t, uint64, uint64, int);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
+int             uvmsplit(pagetable_t, uint64);
 uint64          walkaddr(pagetable_t, uint64);
+uint64          vmfault(pagetable_t, uint64, int);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
@@ -181,6 +232,7 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_rwv(struct buf **, int, int);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
@@ -7,17 +7,35 @@
 #include "defs.h"
 #include "elf.h"
 
-static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
+// Map the ELF segment flags to PTE permissions.
+static int
+flags2perm(int flags)
+{
+  int perm = PTE_R;
+
+  if(flags & ELF_PROG_FLAG_EXEC)
+    perm |= PTE_X;
+  if(flags & ELF_PROG_FLAG_WRITE)
+    perm |= PTE_W;
+  return perm;
+}
 
+// Program segments are not read in by exec(); execfault()
+// reads each page from the program file when it is first
+// touched. A page that is wholly file data is the inode's
+// shared copy from igetpage(), mapped read-only, or
+// copy-on-write in a writable segment, so all processes
+// running a program share its text.
 int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nseg;
   uint64 argc, sz = 0, sp, ustack[MAXARG+1], stackbase;
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *oldexe;
   struct proghdr ph;
+  struct seg seg[NSEG];
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
@@ -38,7 +56,10 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Note where the program's segments go; they are read in
+  // on demand.
+  memset(seg, 0, sizeof(seg));
+  nseg = 0;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -48,18 +69,23 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
-      goto bad;
-    sz = sz1;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(ph.vaddr < sz || ph.vaddr + ph.memsz > TRAPFRAME)
+      goto bad;
+    if(nseg >= NSEG)
       goto bad;
+    seg[nseg].va = ph.vaddr;
+    seg[nseg].memsz = ph.memsz;
+    seg[nseg].filesz = ph.filesz;
+    seg[nseg].off = ph.off;
+    seg[nseg].perm = flags2perm(ph.flags);
+    nseg++;
+    sz = ph.vaddr + ph.memsz;
   }
-  iunlockput(ip);
+  // keep ip, for execfault().
+  iunlock(ip);
   end_op();
-  ip = 0;
 
   p = myproc();
   uint64 oldsz = p->sz;
@@ -69,7 +95,7 @@ exec(char *path, char **argv)
   sz = PGROUNDUP(sz);
   uint64 sz1;
   if((sz1 = uvmalloc(pagetable, sz, sz + 2*PGSIZE)) == 0)
-    goto bad;
+    goto bad1;
   sz = sz1;
   uvmclear(pagetable, sz-2*PGSIZE);
   sp = sz;
@@ -78,13 +104,13 @@ exec(char *path, char **argv)
   // Push argument strings, prepare rest of stack in ustack.
   for(argc = 0; argv[argc]; argc++) {
     if(argc >= MAXARG)
-      goto bad;
+      goto bad1;
     sp -= strlen(argv[argc]) + 1;
     sp -= sp % 16; // riscv sp must be 16-byte aligned
     if(sp < stackbase)
-      goto bad;
+      goto bad1;
     if(copyout(pagetable, sp, argv[argc], strlen(argv[argc]) + 1) < 0)
-      goto bad;
+      goto bad1;
     ustack[argc] = sp;
   }
   ustack[argc] = 0;
@@ -93,9 +119,9 @@ exec(char *path, char **argv)
   sp -= (argc+1) * sizeof(uint64);
   sp -= sp % 16;
   if(sp < stackbase)
-    goto bad;
+    goto bad1;
   if(copyout(pagetable, sp, (char *)ustack, (argc+1)*sizeof(uint64)) < 0)
-    goto bad;
+    goto bad1;
 
   // arguments to user main(argc, argv)
   // argc is returned via the system call return
@@ -109,49 +135,127 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  munmapall(p);
   oldpagetable = p->pagetable;
+  oldexe = p->exe;
   p->pagetable = pagetable;
   p->sz = sz;
+  p->exe = ip;
+  memmove(p->seg, seg, sizeof(seg));
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
+  if(oldexe){
+    begin_op();
+    iput(oldexe);
+    end_op();
+  }
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
  bad:
   if(pagetable)
     proc_freepagetable(pagetable, sz);
-  if(ip){
-    iunlockput(ip);
-    end_op();
-  }
+  iunlockput(ip);
+  end_op();
+  return -1;
+
+ bad1:
+  proc_freepagetable(pagetable, sz);
+  begin_op();
+  iput(ip);
+  end_op();
   return -1;
 }
 
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
+// Return the segment of p's program that overlaps
+// [va, va+len), or 0.
+struct seg*
+execseg(struct proc *p, uint64 va, uint64 len)
+{
+  struct seg *s;
+
+  for(s = p->seg; s < &p->seg[NSEG]; s++){
+    if(s->memsz > 0 && va < s->va + s->memsz && va + len > s->va)
+      return s;
+  }
+  return 0;
+}
+
+// Read in the page of p's program that contains va, and map
+// it. Returns the physical address of the page, or 0 if va
+// is not in a segment, the access is not allowed, or memory
+// is exhausted.
+// Must not be called with a spinlock held, since it reads
+// the file.
+uint64
+execfault(struct proc *p, uint64 va, int write)
+{
+  struct seg *s;
+  uint64 o, pa;
+  char *mem;
+  int perm, n;
+
+  va = PGROUNDDOWN(va);
+  if((s = execseg(p, va, PGSIZE)) == 0)
+    return 0;
+  if(write && (s->perm & PTE_W) == 0)
+    return 0;
+  o = va - s->va;
+  perm = s->perm | PTE_U;
+
+  // a whole page of file data, not about to be written:
+  // share the inode's copy.
+  if(!write && o + PGSIZE <= s->filesz && s->off % PGSIZE == 0){
+    ilock(p->exe);
+    pa = igetpage(p->exe, (s->off + o) / PGSIZE);
+    iunlock(p->exe);
+    if(pa != 0){
+      if(perm & PTE_W)
+        perm = (perm & ~PTE_W) | PTE_COW;
+      if(mappages(p->pagetable, va, PGSIZE, pa, perm) != 0){
+        kfree((void*)pa);
+        return 0;
+      }
+      return pa;
+    }
+  }
+
+  // a private copy, zero past the end of the file data.
+  if((mem = kalloc()) == 0)
+    return 0;
+  memset(mem, 0, PGSIZE);
+  if(o < s->filesz){
+    n = s->filesz - o < PGSIZE ? s->filesz - o : PGSIZE;
+    ilock(p->exe);
+    if(readi(p->exe, 0, (uint64)mem, s->off + o, n) != n){
+      iunlock(p->exe);
+      kfree(mem);
+      return 0;
+    }
+    iunlock(p->exe);
+  }
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    kfree(mem);
+    return 0;
+  }
+  return (uint64)mem;
+}
+
+// Read in any not-yet-present pages of p's program in the
+// user range [va, va+n), so that copyin()/copyout() on that
+// range won't have to read the file while holding a spinlock
+// or the lock of the very inode being read.
+// Returns -1 if a page can't be read in.
+int
+execprefault(struct proc *p, uint64 va, uint64 n, int write)
 {
-  uint i, n;
-  uint64 pa;
-
-  if((va % PGSIZE) != 0)
-    panic("loadseg: va must be page aligned");
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
+  uint64 a;
+
+  for(a = PGROUNDDOWN(va); a < va + n; a += PGSIZE){
+    if(execseg(p, a, PGSIZE) && walkaddr(p->pagetable, a) == 0 &&
+       execfault(p, a, write) == 0)
       return -1;
   }
-  
   return 0;
 }
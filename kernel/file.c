@@ -12,17 +12,24 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "slab.h"
 
 struct devsw devsw[NDEV];
+
+// file structures come from filecache, so there is no
+// limit on open files but memory; ftable.lock protects
+// their reference counts.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
 } ftable;
 
+static struct kcache filecache;
+
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  kcache_init(&filecache, "file", sizeof(struct file), 0);
 }
 
 // Allocate a file structure.
@@ -31,16 +38,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kcache_alloc(&filecache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -69,9 +71,8 @@ fileclose(struct file *f)
     return;
   }
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
   release(&ftable.lock);
+  kcache_free(&filecache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -111,6 +112,12 @@ fileread(struct file *f, uint64 addr, int n)
   if(f->readable == 0)
     return -1;
 
+  // read mapped-file and program pages in now, before
+  // taking locks.
+  if(n > 0 && (mmapprefault(myproc(), addr, n, 1) < 0 ||
+               execprefault(myproc(), addr, n, 1) < 0))
+    return -1;
+
   if(f->type == FD_PIPE){
     r = piperead(f->pipe, addr, n);
   } else if(f->type == FD_DEVICE){
@@ -139,6 +146,12 @@ filewrite(struct file *f, uint64 addr, int n)
   if(f->writable == 0)
     return -1;
 
+  // read mapped-file and program pages in now, before
+  // taking locks.
+  if(n > 0 && (mmapprefault(myproc(), addr, n, 0) < 0 ||
+               execprefault(myproc(), addr, n, 0) < 0))
+    return -1;
+
   if(f->type == FD_PIPE){
     ret = pipewrite(f->pipe, addr, n);
   } else if(f->type == FD_DEVICE){
@@ -166,10 +179,10 @@ filewrite(struct file *f, uint64 addr, int n)
       iunlock(f->ip);
       end_op();
 
-      if(r < 0)
+      if(r != n1){
+        // error from writei, or the disk is full.
         break;
-      if(r != n1)
-        panic("short filewrite");
+      }
       i += r;
     }
     ret = (i == n ? n : -1);
@@ -180,3 +193,61 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+
+// Move up to n bytes from file in to file out, one of which
+// must be a pipe and the other an inode, copying directly
+// between the buffer cache and the pipe's buffer.
+// From a file, stops at end of file; from a pipe, stops
+// when it is empty once something has been moved.
+int
+filesplice(struct file *in, struct file *out, int n)
+{
+  int r, m, tot = 0;
+  char *a;
+
+  if(in->readable == 0 || out->writable == 0)
+    return -1;
+
+  if(in->type == FD_INODE && out->type == FD_PIPE){
+    while(tot < n){
+      if((m = pipewbegin(out->pipe, n - tot, &a)) < 0)
+        return tot > 0 ? tot : -1;
+      ilock(in->ip);
+      if((r = readi(in->ip, 0, (uint64)a, in->off, m)) > 0)
+        in->off += r;
+      iunlock(in->ip);
+      pipewend(out->pipe, r);
+      tot += r;
+      if(r < m)
+        break;  // end of file
+    }
+    return tot;
+  } else if(in->type == FD_PIPE && out->type == FD_INODE){
+    // see filewrite() for the limit on one transaction.
+    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    while(tot < n){
+      int n1 = n - tot;
+      if(n1 > max)
+        n1 = max;
+      if((m = piperbegin(in->pipe, n1, &a, tot == 0)) <= 0)
+        return tot > 0 ? tot : m;
+      begin_op();
+      ilock(out->ip);
+      if((r = writei(out->ip, 0, (uint64)a, out->off, m)) > 0)
+        out->off += r;
+      iunlock(out->ip);
+      end_op();
+      if(r != m){
+        // the disk is full; keep what didn't fit in the pipe.
+        r = r > 0 ? r : 0;
+        piperend(in->pipe, r);
+        tot += r;
+        return tot > 0 ? tot : -1;
+      }
+      piperend(in->pipe, r);
+      tot += r;
+    }
+    return tot;
+  }
+  return -1;
+}
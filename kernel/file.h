@@ -18,15 +18,24 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *prev; // icache bucket list
+  struct inode *next;
+  struct inode *lprev; // icache LRU list, while ref is 0
+  struct inode *lnext;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  uint64 *pages;      // shared copies of file pages, for exec; or 0
 
   short type;         // copy of disk inode
   short major;
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  struct extent ext[NEXTENT];
+  uint xaddrs[NXINDIRECT];
+
+  uint hintbn;        // first file block of the extent in hint
+  struct extent hint; // extent bmap() last used, or len 0
 };
 
 // map major device number to device functions.
@@ -20,6 +20,7 @@
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "slab.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 // there should be one superblock per disk device, but we run with
@@ -60,29 +61,56 @@ bzero(int dev, int bno)
 
 // Blocks.
 
-// Allocate a zeroed disk block.
+// Free blocks balloc() looks for after a new extent's first.
+#define NRUN 8
+
+// Is block b free in bitmap block bp, which holds b's bit?
+static int
+bisfree(struct buf *bp, uint b)
+{
+  int bi = b % BPB;
+
+  return (bp->data[bi/8] & (1 << (bi % 8))) == 0;
+}
+
+// Allocate a zeroed disk block: goal itself if it is free, so
+// that a file's blocks are adjacent; otherwise the first free
+// block after goal, wrapping around, that starts a run of
+// NRUN free blocks, to leave the file room to grow; otherwise
+// the first free block. goal 0 asks only for a run.
+// Returns 0 if the disk is full.
 static uint
-balloc(uint dev)
+balloc(uint dev, uint goal)
 {
-  int b, bi, m;
+  int n, j;
+  uint b, i;
   struct buf *bp;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
+  for(n = NRUN; n > 0; n = n > 1 ? 1 : 0){
+    bp = 0;
+    for(i = 0; i < sb.size; i++){
+      b = (goal + i) % sb.size;
+      if(bp == 0 || bp->blockno != BBLOCK(b, sb)){
+        if(bp)
+          brelse(bp);
+        bp = bread(dev, BBLOCK(b, sb));
+      }
+      for(j = 0; j < n && b % BPB + j < BPB && b + j < sb.size; j++){
+        if(!bisfree(bp, b + j))
+          break;
+      }
+      if(j == n || (i == 0 && goal != 0 && j > 0)){
+        bp->data[(b % BPB)/8] |= 1 << (b % 8);  // Mark block in use.
         log_write(bp);
         brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+        bzero(dev, b);
+        return b;
       }
     }
     brelse(bp);
   }
-  panic("balloc: out of blocks");
+  printf("balloc: out of blocks\n");
+  return 0;
 }
 
 // Free a disk block.
@@ -162,28 +190,129 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The icache.lock spin-lock protects the allocation of icache
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold icache.lock while using any of those fields.
+// Entries come from inodecache and are hashed by (dev, inum)
+// into NIBUCKET buckets. Each bucket's lock protects its list
+// and the ref of the inodes on it; ip->dev and ip->inum never
+// change once an entry is in a bucket. Lookups of different
+// i-nodes on different CPUs thus rarely contend.
+//
+// An entry whose ref falls to 0 stays in its bucket, still
+// valid, so a later iget() of the same i-node needn't read it
+// from disk again; it also goes on the icache.lru list. When
+// more than NINODE entries are unused, the least recently
+// used are freed. The number of active i-nodes is limited
+// only by memory. icache.lock protects the LRU list and
+// icache.nlru; take it after a bucket lock, never before.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
-// dev, and inum.  One must hold ip->lock in order to
+// dev, inum, and the list links.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIBUCKET 31
+#define IHASH(dev, inum) ((((uint64)(dev) << 32) | (inum)) % NIBUCKET)
+
+struct ibucket {
+  struct spinlock lock;
+  struct inode head;  // list of the bucket's entries, through prev/next
+};
+
 struct {
+  struct ibucket bucket[NIBUCKET];
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode lru;   // unused entries, most recent first, through lprev/lnext
+  int nlru;           // entries on the LRU list
 } icache;
 
+static struct kcache inodecache;
+
+static void
+inodector(void *o)
+{
+  initsleeplock(&((struct inode*)o)->lock, "inode");
+  ((struct inode*)o)->pages = 0;
+}
+
 void
 iinit()
 {
-  int i = 0;
-  
-  initlock(&icache.lock, "icache");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
+  struct ibucket *bk;
+
+  for(bk = icache.bucket; bk < icache.bucket+NIBUCKET; bk++){
+    initlock(&bk->lock, "icache");
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
+  }
+  initlock(&icache.lock, "icache.lru");
+  icache.lru.lprev = &icache.lru;
+  icache.lru.lnext = &icache.lru;
+  kcache_init(&inodecache, "inode", sizeof(struct inode), inodector);
+}
+
+static struct ibucket*
+ibucket(uint dev, uint inum)
+{
+  return &icache.bucket[IHASH(dev, inum)];
+}
+
+// Put unused ip at the front of the LRU list.
+// Caller must hold ip's bucket lock.
+static void
+lruinsert(struct inode *ip)
+{
+  acquire(&icache.lock);
+  ip->lnext = icache.lru.lnext;
+  ip->lprev = &icache.lru;
+  icache.lru.lnext->lprev = ip;
+  icache.lru.lnext = ip;
+  icache.nlru++;
+  release(&icache.lock);
+}
+
+// Take ip off the LRU list, as it is used again or freed.
+// Caller must hold ip's bucket lock.
+static void
+lruremove(struct inode *ip)
+{
+  acquire(&icache.lock);
+  ip->lnext->lprev = ip->lprev;
+  ip->lprev->lnext = ip->lnext;
+  icache.nlru--;
+  release(&icache.lock);
+}
+
+// Free least recently used entries until no more than NINODE
+// are unused. Holds one lock at a time: notes the oldest
+// entry's i-node under icache.lock, then takes that bucket's
+// lock and frees the entry if it is still unused.
+static void
+itrim(void)
+{
+  struct ibucket *bk;
+  struct inode *ip, *victim;
+
+  for(;;){
+    acquire(&icache.lock);
+    if(icache.nlru <= NINODE){
+      release(&icache.lock);
+      return;
+    }
+    victim = icache.lru.lprev;
+    bk = ibucket(victim->dev, victim->inum);
+    release(&icache.lock);
+
+    acquire(&bk->lock);
+    for(ip = bk->head.next; ip != &bk->head && ip != victim; ip = ip->next)
+      ;
+    if(ip != victim || ip->ref != 0){
+      // used or freed meanwhile.
+      release(&bk->lock);
+      continue;
+    }
+    ip->next->prev = ip->prev;
+    ip->prev->next = ip->next;
+    lruremove(ip);
+    release(&bk->lock);
+    kcache_free(&inodecache, ip);
   }
 }
 
@@ -231,7 +360,8 @@ iupdate(struct inode *ip)
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
-  memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
+  memmove(dip->ext, ip->ext, sizeof(ip->ext));
+  memmove(dip->xaddrs, ip->xaddrs, sizeof(ip->xaddrs));
   log_write(bp);
   brelse(bp);
 }
@@ -242,34 +372,50 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct ibucket *bk = ibucket(dev, inum);
+  struct inode *ip, *new;
 
-  acquire(&icache.lock);
+  acquire(&bk->lock);
 
   // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
+  for(ip = bk->head.next; ip != &bk->head; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref == 0)
+        lruremove(ip);
       ip->ref++;
-      release(&icache.lock);
+      release(&bk->lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
+  release(&bk->lock);
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
+  // Make a new inode cache entry.
+  if((new = kcache_alloc(&inodecache)) == 0)
     panic("iget: no inodes");
+  new->dev = dev;
+  new->inum = inum;
+  new->ref = 1;
+  new->valid = 0;
+
+  acquire(&bk->lock);
+  for(ip = bk->head.next; ip != &bk->head; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
+      // Another process cached it while we held no lock.
+      if(ip->ref == 0)
+        lruremove(ip);
+      ip->ref++;
+      release(&bk->lock);
+      kcache_free(&inodecache, new);
+      return ip;
+    }
+  }
+  new->next = bk->head.next;
+  new->prev = &bk->head;
+  bk->head.next->prev = new;
+  bk->head.next = new;
+  release(&bk->lock);
 
-  ip = empty;
-  ip->dev = dev;
-  ip->inum = inum;
-  ip->ref = 1;
-  ip->valid = 0;
-  release(&icache.lock);
-
-  return ip;
+  return new;
 }
 
 // Increment reference count for ip.
@@ -277,9 +423,11 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&icache.lock);
+  struct ibucket *bk = ibucket(ip->dev, ip->inum);
+
+  acquire(&bk->lock);
   ip->ref++;
-  release(&icache.lock);
+  release(&bk->lock);
   return ip;
 }
 
@@ -304,7 +452,9 @@ ilock(struct inode *ip)
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
-    memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    memmove(ip->ext, dip->ext, sizeof(ip->ext));
+    memmove(ip->xaddrs, dip->xaddrs, sizeof(ip->xaddrs));
+    ip->hint.len = 0;
     brelse(bp);
     ip->valid = 1;
     if(ip->type == 0)
@@ -323,8 +473,8 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode cache entry can
-// be recycled.
+// If that was the last reference, the inode cache entry goes
+// on the LRU list, to be reused or freed.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -332,7 +482,9 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&icache.lock);
+  struct ibucket *bk = ibucket(ip->dev, ip->inum);
+
+  acquire(&bk->lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
@@ -341,8 +493,10 @@ iput(struct inode *ip)
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&icache.lock);
+    release(&bk->lock);
 
+    if(ip->type == T_DIR)
+      dcachepurge(ip->dev, ip->inum);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
@@ -350,11 +504,70 @@ iput(struct inode *ip)
 
     releasesleep(&ip->lock);
 
-    acquire(&icache.lock);
+    acquire(&bk->lock);
   }
 
   ip->ref--;
-  release(&icache.lock);
+  if(ip->ref == 0){
+    ipagesfree(ip);
+    lruinsert(ip);
+  }
+  release(&bk->lock);
+
+  itrim();
+}
+
+// Pages of file data that igetpage() can keep per inode.
+#define NIPAGES (PGSIZE / sizeof(uint64))
+
+// Return the physical address of a copy of page pn of ip's
+// data, zero-filled past the end of the file. The copy is
+// kept with ip and shared by all callers, so they must not
+// write it; each gets a reference to the page of its own.
+// ip drops its copies when it is written or truncated, or
+// when its last reference goes. Returns 0 if out of memory, or if
+// pn is too far into the file to keep.
+// Caller must hold ip->lock.
+uint64
+igetpage(struct inode *ip, uint pn)
+{
+  char *mem;
+
+  if(pn >= NIPAGES)
+    return 0;
+  if(ip->pages == 0){
+    if((ip->pages = (uint64*)kalloc()) == 0)
+      return 0;
+    memset(ip->pages, 0, PGSIZE);
+  }
+  if(ip->pages[pn] == 0){
+    if((mem = kalloc()) == 0)
+      return 0;
+    memset(mem, 0, PGSIZE);
+    if(readi(ip, 0, (uint64)mem, pn * PGSIZE, PGSIZE) < 0){
+      kfree(mem);
+      return 0;
+    }
+    ip->pages[pn] = (uint64)mem;
+  }
+  krefinc((void*)ip->pages[pn]);
+  return ip->pages[pn];
+}
+
+// Drop ip's copies of its pages. Pages that processes still
+// map stay with them.
+// Caller must hold ip->lock, or ip->ref must be 0.
+void
+ipagesfree(struct inode *ip)
+{
+  if(ip->pages == 0)
+    return;
+  for(int i = 0; i < NIPAGES; i++){
+    if(ip->pages[i])
+      kfree((void*)ip->pages[i]);
+  }
+  kfree(ip->pages);
+  ip->pages = 0;
 }
 
 // Common idiom: unlock, then put.
@@ -368,40 +581,186 @@ iunlockput(struct inode *ip)
 // Inode content
 //
 // The content (data) associated with each inode is stored
-// in blocks on the disk. The first NDIRECT block numbers
-// are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
-
-// Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// in blocks on the disk, in runs of consecutive blocks called
+// extents. The first NEXTENT extents are in ip->ext[], the
+// rest in the single, double and triple indirect blocks
+// listed in ip->xaddrs[]. bmap() remembers
+// the extent it last used in ip->hint, so a sequential read
+// or write usually finds its block without walking the list.
+
+// Allocate block bn, the first after the end of ip's data,
+// and record it in the unused extent slot e, or in last, the
+// extent before e, if it is adjacent. last is 0 if it is not
+// in the same place as e; goal is the block after its end, or
+// 0. e and last are in buffer bp, or in the inode if bp is 0.
 static uint
-bmap(struct inode *ip, uint bn)
+bmapappend(struct inode *ip, uint bn, struct extent *e,
+           struct extent *last, uint goal, struct buf *bp)
 {
-  uint addr, *a;
-  struct buf *bp;
+  uint addr;
 
-  if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
-    return addr;
+  if((addr = balloc(ip->dev, goal)) == 0)
+    return 0;
+  if(last && addr == goal){
+    last->len++;
+    e = last;
+  } else {
+    e->start = addr;
+    e->len = 1;
   }
-  bn -= NDIRECT;
+  if(bp)
+    log_write(bp);
+  ip->hintbn = bn + 1 - e->len;
+  ip->hint = *e;
+  return addr;
+}
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
+// Look for block bn of ip in the extent tree of the given depth
+// rooted at *root: a block of XPB extents if depth is 0, else a
+// block of NXPTR addresses of trees of depth-1. *lbn is the
+// file block the tree's first extent starts at and *goal the
+// block after the extent before it; both are advanced past the
+// tree. If the extents end inside the tree, appends bn there,
+// allocating *root if it is 0.
+// Returns 1 and sets *addr if it finds or appends bn, 0 if bn
+// is past a full tree, or -1 if out of disk space.
+static int
+bmaptree(struct inode *ip, uint *root, int depth, uint bn,
+         uint *lbn, uint *goal, uint *addr)
+{
+  struct buf *bp;
+  struct extent *e, *last;
+  uint *a, old;
+  int i, r;
+
+  if(*root == 0){
+    if(bn != *lbn)
+      panic("bmap: hole");
+    if((*root = balloc(ip->dev, 0)) == 0)
+      return -1;
+  }
+  bp = bread(ip->dev, *root);
+
+  if(depth > 0){
     a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
+    for(i = 0; i < NXPTR; i++){
+      old = a[i];
+      r = bmaptree(ip, &a[i], depth-1, bn, lbn, goal, addr);
+      if(a[i] != old)
+        log_write(bp);
+      if(r != 0){
+        brelse(bp);
+        return r;
+      }
     }
     brelse(bp);
-    return addr;
+    return 0;
   }
 
-  panic("bmap: out of range");
+  last = 0;
+  for(i = 0; i < XPB; i++){
+    e = (struct extent*)bp->data + i;
+    if(e->len == 0){
+      if(bn != *lbn)
+        panic("bmap: hole");
+      *addr = bmapappend(ip, bn, e, last, *goal, bp);
+      brelse(bp);
+      return *addr ? 1 : -1;
+    }
+    if(bn < *lbn + e->len){
+      ip->hintbn = *lbn;
+      ip->hint = *e;
+      *addr = e->start + (bn - *lbn);
+      brelse(bp);
+      return 1;
+    }
+    *lbn += e->len;
+    last = e;
+    *goal = e->start + e->len;
+  }
+  brelse(bp);
+  return 0;
+}
+
+// Return the disk block address of the nth block in inode ip.
+// If there is no such block, bmap allocates one, preferably
+// the one after the last extent, to make that extent longer.
+// Returns 0 if out of disk space or extent slots.
+static uint
+bmap(struct inode *ip, uint bn)
+{
+  struct extent *e, *last;
+  uint lbn, goal, addr;
+  int i, k;
+
+  if(ip->hint.len > 0 && bn >= ip->hintbn && bn < ip->hintbn + ip->hint.len)
+    return ip->hint.start + (bn - ip->hintbn);
+
+  // The extents in the inode.
+  lbn = 0;
+  last = 0;
+  goal = 0;
+  for(i = 0; i < NEXTENT; i++){
+    e = &ip->ext[i];
+    if(e->len == 0)
+      goto append;
+    if(bn < lbn + e->len)
+      goto found;
+    lbn += e->len;
+    last = e;
+    goal = e->start + e->len;
+  }
+
+  // The extents in the single, double and triple indirect blocks.
+  for(k = 0; k < NXINDIRECT; k++){
+    switch(bmaptree(ip, &ip->xaddrs[k], k, bn, &lbn, &goal, &addr)){
+    case 1:
+      return addr;
+    case -1:
+      return 0;
+    }
+  }
+  return 0;
+
+ append:
+  if(bn != lbn)
+    panic("bmap: hole");
+  return bmapappend(ip, bn, e, last, goal, 0);
+
+ found:
+  ip->hintbn = lbn;
+  ip->hint = *e;
+  return e->start + (bn - lbn);
+}
+
+// Free the blocks of extent e.
+static void
+freeextent(uint dev, struct extent *e)
+{
+  for(uint b = 0; b < e->len; b++)
+    bfree(dev, e->start + b);
+}
+
+// Free the extent tree of the given depth rooted at block
+// root, the blocks its extents map, and root itself.
+static void
+freetree(uint dev, uint root, int depth)
+{
+  struct buf *bp;
+  int i;
+
+  bp = bread(dev, root);
+  if(depth > 0){
+    for(i = 0; i < NXPTR; i++){
+      if(((uint*)bp->data)[i])
+        freetree(dev, ((uint*)bp->data)[i], depth-1);
+    }
+  } else {
+    for(i = 0; i < XPB; i++)
+      freeextent(dev, (struct extent*)bp->data + i);
+  }
+  brelse(bp);
+  bfree(dev, root);
 }
 
 // Truncate inode (discard contents).
@@ -409,29 +768,23 @@ bmap(struct inode *ip, uint bn)
 void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i, k;
 
-  for(i = 0; i < NDIRECT; i++){
-    if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
-    }
+  ipagesfree(ip);
+  for(i = 0; i < NEXTENT; i++){
+    freeextent(ip->dev, &ip->ext[i]);
+    ip->ext[i].start = 0;
+    ip->ext[i].len = 0;
   }
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
+  for(k = 0; k < NXINDIRECT; k++){
+    if(ip->xaddrs[k] == 0)
+      continue;
+    freetree(ip->dev, ip->xaddrs[k], k);
+    ip->xaddrs[k] = 0;
   }
 
+  ip->hint.len = 0;
   ip->size = 0;
   iupdate(ip);
 }
@@ -455,7 +808,7 @@ stati(struct inode *ip, struct stat *st)
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addr;
   struct buf *bp;
 
   if(off > ip->size || off + n < off)
@@ -464,7 +817,9 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    if((addr = bmap(ip, off/BSIZE)) == 0)
+      break;
+    bp = bread(ip->dev, addr);
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
@@ -482,7 +837,7 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 int
 writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addr;
   struct buf *bp;
 
   if(off > ip->size || off + n < off)
@@ -490,8 +845,11 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   if(off + n > MAXFILE*BSIZE)
     return -1;
 
+  ipagesfree(ip);
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    if((addr = bmap(ip, off/BSIZE)) == 0)
+      break;
+    bp = bread(ip->dev, addr);
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
       brelse(bp);
@@ -506,11 +864,11 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       ip->size = off;
     // write the i-node back to disk even if the size didn't change
     // because the loop above might have called bmap() and added a new
-    // block to ip->addrs[].
+    // block to ip->ext[].
     iupdate(ip);
   }
 
-  return n;
+  return tot;
 }
 
 // Directories
@@ -521,35 +879,232 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
-// Look for a directory entry in a directory.
-// If found, set *poff to byte offset of entry.
-struct inode*
-dirlookup(struct inode *dp, char *name, uint *poff)
+// Return the index depth of directory dp if it is hashed,
+// or -1 if it is a linear array of dirents.
+// Caller must hold dp->lock.
+static int
+dirdepth(struct inode *dp)
 {
-  uint off, inum;
-  struct dirent de;
+  struct dirslot hs;
 
-  if(dp->type != T_DIR)
-    panic("dirlookup not DIR");
+  if(dp->size < 2*BSIZE)
+    return -1;
+  if(readi(dp, 0, (uint64)&hs, DIRHDRSLOT*sizeof(hs), sizeof(hs)) != sizeof(hs))
+    panic("dirdepth read");
+  if(hs.inum != 0 || hs.word[0] != DIRMAGIC)
+    return -1;
+  return hs.word[1];
+}
+
+// Return the block of hashed directory dp that holds the
+// entries whose names hash to h.
+static uint
+dirblock(struct inode *dp, int depth, uint h)
+{
+  ushort b;
+
+  if(readi(dp, 0, (uint64)&b, DIRIDXOFF(h & ((1 << depth) - 1)), sizeof(b)) != sizeof(b))
+    panic("dirblock read");
+  return b;
+}
+
+// Look for name among the entries of dp in [start, end).
+// Returns its offset, setting *inum, or -1.
+static int
+dirscan(struct inode *dp, char *name, uint start, uint end, uint *inum)
+{
+  uint off;
+  struct dirent de;
 
-  for(off = 0; off < dp->size; off += sizeof(de)){
+  for(off = start; off < end; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
     if(de.inum == 0)
       continue;
     if(namecmp(name, de.name) == 0){
       // entry matches path element
-      if(poff)
-        *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
+      *inum = de.inum;
+      return off;
     }
   }
+  return -1;
+}
+
+// Look for a directory entry in a directory, first in the
+// directory entry cache. A hashed directory needs only its
+// first block, for "." and "..", and the block name hashes to.
+// If found, set *poff to byte offset of entry.
+// Caller must hold dp->lock.
+struct inode*
+dirlookup(struct inode *dp, char *name, uint *poff)
+{
+  uint inum, b, coff;
+  int off, depth;
+
+  if(dp->type != T_DIR)
+    panic("dirlookup not DIR");
+
+  if(dcachelookup(dp, name, &inum, &coff)){
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = coff;
+    return iget(dp->dev, inum);
+  }
 
+  if((depth = dirdepth(dp)) < 0){
+    off = dirscan(dp, name, 0, dp->size, &inum);
+  } else if((off = dirscan(dp, name, 0, 2*sizeof(struct dirent), &inum)) < 0){
+    b = dirblock(dp, depth, dirhash(name));
+    off = dirscan(dp, name, b*BSIZE, (b+1)*BSIZE, &inum);
+  }
+
+  if(off < 0){
+    dcacheenter(dp, name, 0, 0);
+    return 0;
+  }
+  if(poff)
+    *poff = off;
+  dcacheenter(dp, name, inum, off);
+  return iget(dp->dev, inum);
+}
+
+// Split full block b of a hashed directory, moving the entries
+// whose hashes have the next bit set to new block nb. hdr, bk
+// and nbk hold the first block, b and nb. Doubles the index if
+// b is the only block for its hashes at the current depth.
+// Returns -1 if the index can't double.
+static int
+dirsplit(char *hdr, char *bk, char *nbk, uint b, uint nb)
+{
+  struct dirent *de, *nde;
+  int depth, ld, n, i;
+
+  // 2^(depth - ld) index entries lead to a block with
+  // local depth ld.
+  depth = DIRDEPTHOF(hdr);
+  n = 0;
+  for(i = 0; i < (1 << depth); i++){
+    if(DIRIDX(hdr, i) == b)
+      n++;
+  }
+  for(ld = depth; n > 1; n >>= 1)
+    ld--;
+  if(ld == depth){
+    if(depth == DIRMAXDEPTH)
+      return -1;
+    for(i = 0; i < (1 << depth); i++)
+      DIRIDX(hdr, i + (1 << depth)) = DIRIDX(hdr, i);
+    DIRDEPTHOF(hdr) = ++depth;
+  }
+
+  memset(nbk, 0, BSIZE);
+  nde = (struct dirent*)nbk;
+  for(de = (struct dirent*)bk; de < (struct dirent*)(bk + BSIZE); de++){
+    if(de->inum != 0 && (dirhash(de->name) >> ld) & 1){
+      *nde++ = *de;
+      memset(de, 0, sizeof(*de));
+    }
+  }
+  for(i = 0; i < (1 << depth); i++){
+    if(DIRIDX(hdr, i) == b && (i >> ld) & 1)
+      DIRIDX(hdr, i) = nb;
+  }
+  return 0;
+}
+
+// Return the offset of a free entry for name in hashed
+// directory dp, splitting the block name hashes to if it is
+// full. A split writes the new block, the split block, the
+// header, a bitmap block and dp's inode, so there is room in
+// the caller's transaction for just one. Returns -1 if the
+// directory can't grow, or if one split didn't make room.
+static int
+dirhashslot(struct inode *dp, char *name)
+{
+  char *hdr, *bk, *nbk;
+  struct dirent *de;
+  uint b, nb, h;
+  int off, split;
+
+  if((hdr = kalloc()) == 0)
+    return -1;
+  bk = hdr + BSIZE;
+  nbk = bk + BSIZE;
+  h = dirhash(name);
+  off = -1;
+  for(split = 0; ; split++){
+    if(readi(dp, 0, (uint64)hdr, 0, BSIZE) != BSIZE)
+      panic("dirhashslot read");
+    b = DIRIDX(hdr, h & ((1 << DIRDEPTHOF(hdr)) - 1));
+    if(readi(dp, 0, (uint64)bk, b*BSIZE, BSIZE) != BSIZE)
+      panic("dirhashslot read");
+    for(de = (struct dirent*)bk; de < (struct dirent*)(bk + BSIZE); de++){
+      if(de->inum == 0){
+        off = b*BSIZE + ((char*)de - bk);
+        break;
+      }
+    }
+    if(off >= 0)
+      break;
+
+    // b is full.
+    nb = dp->size / BSIZE;
+    if(split > 0 || nb >= MAXFILE || dirsplit(hdr, bk, nbk, b, nb) < 0)
+      break;
+    // only the new block needs a disk block, and can fail.
+    if(writei(dp, 0, (uint64)nbk, nb*BSIZE, BSIZE) != BSIZE)
+      break;
+    if(writei(dp, 0, (uint64)bk, b*BSIZE, BSIZE) != BSIZE ||
+       writei(dp, 0, (uint64)hdr, 0, BSIZE) != BSIZE)
+      panic("dirhashslot write");
+    // entries moved.
+    dcachepurge(dp->dev, dp->inum);
+  }
+  kfree(hdr);
+  return off;
+}
+
+// Turn linear directory dp, whose one block is full, into a
+// hashed directory: "." and ".." stay in the first block, with
+// a header and an index of depth 0, and the other entries
+// move to a second block. Returns -1 if dp doesn't start with
+// "." and "..", or if there is no disk block for the second.
+static int
+dirhashconvert(struct inode *dp)
+{
+  char *hdr, *bk;
+  struct dirent *de;
+
+  if((hdr = kalloc()) == 0)
+    return -1;
+  bk = hdr + BSIZE;
+  if(readi(dp, 0, (uint64)bk, 0, BSIZE) != BSIZE)
+    panic("dirhashconvert read");
+  de = (struct dirent*)bk;
+  if(namecmp(de[0].name, ".") != 0 || namecmp(de[1].name, "..") != 0){
+    kfree(hdr);
+    return -1;
+  }
+  memset(hdr, 0, BSIZE);
+  memmove(hdr, bk, 2*sizeof(*de));
+  memset(bk, 0, 2*sizeof(*de));
+  DIRMAGICOF(hdr) = DIRMAGIC;
+  DIRDEPTHOF(hdr) = 0;
+  DIRIDX(hdr, 0) = 1;
+  if(writei(dp, 0, (uint64)bk, BSIZE, BSIZE) != BSIZE){
+    kfree(hdr);
+    return -1;
+  }
+  if(writei(dp, 0, (uint64)hdr, 0, BSIZE) != BSIZE)
+    panic("dirhashconvert write");
+  dcachepurge(dp->dev, dp->inum);
+  kfree(hdr);
   return 0;
 }
 
 // Write a new directory entry (name, inum) into the directory dp.
+// A linear directory whose first block is full becomes hashed.
 int
 dirlink(struct inode *dp, char *name, uint inum)
 {
@@ -563,18 +1118,28 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      break;
+  if(dirdepth(dp) >= 0){
+    if((off = dirhashslot(dp, name)) < 0)
+      return -1;
+  } else {
+    // Look for an empty dirent.
+    for(off = 0; off < dp->size; off += sizeof(de)){
+      if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+        panic("dirlink read");
+      if(de.inum == 0)
+        break;
+    }
+    if(off == BSIZE && dp->size == BSIZE && dirhashconvert(dp) == 0 &&
+       (off = dirhashslot(dp, name)) < 0)
+      return -1;
   }
 
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
+  // appending to a linear directory can find the disk full.
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-    panic("dirlink");
+    return -1;
+  dcacheenter(dp, name, inum, off);
 
   return 0;
 }
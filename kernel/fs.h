@@ -24,9 +24,25 @@ struct superblock {
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
-#define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+// A file's data is a sequence of extents, runs of consecutive
+// disk blocks. The first NEXTENT are in the inode, the rest in
+// blocks of XPB extents each: xaddrs[0] is one such block,
+// xaddrs[1] a block of NXPTR addresses of them (double
+// indirect), and xaddrs[2] a block of NXPTR addresses of
+// double indirect blocks (triple indirect). An extent with
+// len 0 ends the sequence.
+struct extent {
+  uint start;           // first disk block
+  uint len;             // number of blocks
+};
+
+#define NEXTENT 5
+#define NXINDIRECT 3
+#define XPB (BSIZE / sizeof(struct extent))
+#define NXPTR (BSIZE / sizeof(uint))
+// the most blocks a file can have. Even if no two are adjacent
+// the extents could map more; the 32-bit size is the limit.
+#define MAXFILE (0xffffffffU / BSIZE)
 
 // On-disk inode structure
 struct dinode {
@@ -35,7 +51,8 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  struct extent ext[NEXTENT];  // Data block extents
+  uint xaddrs[NXINDIRECT];     // Single, double, triple indirect extents
 };
 
 // Inodes per block.
@@ -58,3 +75,44 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// Dirents per block.
+#define DPB           (BSIZE / sizeof(struct dirent))
+
+// A large directory is hashed. Its first block holds "." and
+// "..", then a header and an index in dirent-sized slots whose
+// inum is 0, so programs reading the directory skip them. The
+// index maps the low depth bits of dirhash(name) to the block
+// that holds name's entry, if any; every other block is an
+// array of dirents. A full block is split in two, doubling
+// the index if need be (extendible hashing).
+struct dirslot {
+  ushort inum;          // always 0
+  ushort word[DIRSIZ/sizeof(ushort)];
+};
+
+#define DIRMAGIC     0x4844  // header word[0]; word[1] is the depth
+#define DIRHDRSLOT   2       // slot of the header
+#define DIRIDXSLOT   3       // slot of the start of the index
+#define DIRIDXPER    (DIRSIZ/sizeof(ushort))  // index entries per slot
+#define DIRMAXDEPTH  8
+
+// Offset in the first block of index entry i.
+#define DIRIDXOFF(i) \
+  ((DIRIDXSLOT + (i)/DIRIDXPER) * sizeof(struct dirent) + \
+   sizeof(ushort) * (1 + (i)%DIRIDXPER))
+
+// Header fields and index entries, in a copy of the first block.
+#define DIRMAGICOF(blk) (((struct dirslot*)(blk))[DIRHDRSLOT].word[0])
+#define DIRDEPTHOF(blk) (((struct dirslot*)(blk))[DIRHDRSLOT].word[1])
+#define DIRIDX(blk, i)  (*(ushort*)((char*)(blk) + DIRIDXOFF(i)))
+
+static inline uint
+dirhash(const char *name)
+{
+  uint h = 2166136261U;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619U;
+  return h;
+}
+
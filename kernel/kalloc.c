@@ -1,12 +1,35 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or physically contiguous blocks of 2^order pages.
+//
+// Free memory is kept by a buddy allocator. A free block of
+// order k is 2^k pages, aligned to its size; freeing a block
+// whose buddy (the other half of the block of order k+1) is
+// also free merges the two, so memory freed page by page
+// comes back together into large blocks. kalloc_pages()
+// splits larger blocks as needed.
+//
+// Single pages are also cached per CPU, so kalloc() and
+// kfree() on different CPUs don't contend. A CPU whose cache
+// runs dry refills it with a batch from the buddy allocator,
+// and gives a batch back when the cache grows long. Only
+// when the buddy allocator is empty too does a CPU steal
+// pages from another CPU's cache.
+//
+// Every allocated page has a reference count, so that
+// copy-on-write fork() can share a page between page tables.
+// kalloc() sets it to 1, krefinc() adds a reference, and
+// kfree() only puts the page back on a free list when the
+// last reference goes away. The pages of a block from
+// kalloc_pages() have counts of their own too.
 
 #include "types.h"
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
 #include "riscv.h"
+#include "memstat.h"
 #include "defs.h"
 
 void freerange(void *pa_start, void *pa_end);
@@ -14,39 +37,158 @@ void freerange(void *pa_start, void *pa_end);
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
+#define KBATCH 32   // pages moved between a cache and the buddy allocator
+#define KCACHE 128  // most pages a CPU's cache keeps
+#define NSTEAL 64   // most pages taken from another CPU's cache
+
 struct run {
   struct run *next;
+  struct run *prev;  // buddy free lists only
 };
 
-struct {
+struct kmem {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;   // pages on freelist
+  int nhit;    // kalloc()s satisfied from freelist
+  int nrefill; // kalloc()s that refilled from the buddy allocator
+  int nsteal;  // kalloc()s that had to steal
+  int nstolen; // pages taken from other CPUs
+};
+
+struct kmem kmem[NCPU];
+
+// reference counts of allocated pages, indexed by
+// physical page number. updated with atomic
+// instructions, so no lock is needed.
+#define PA2REF(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define REF2PA(i) (KERNBASE + (uint64)(i) * PGSIZE)
+#define NPAGES PA2REF(PHYSTOP)
+int kref[NPAGES];
+
+struct {
+  struct spinlock lock;
+  struct run *freelist[MAXORDER+1];
+  int nfree[MAXORDER+1];   // blocks on each list
+  int nalloc[MAXORDER+1];  // kalloc_pages() calls that succeeded
+  int nfail[MAXORDER+1];   // and that failed
+  uchar order[NPAGES];     // 1+order of a free block starting here, else 0
+} buddy;
+
+int npages;  // pages handed to the allocator by kinit()
+
+static void kfree1(struct kmem *km, void *pa);
+static void buddyfree(uint64 pa, int order);
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem");
+  initlock(&buddy.lock, "buddy");
   freerange(end, (void*)PHYSTOP);
 }
 
+// Free [pa_start, pa_end) as the largest aligned blocks
+// that fit.
 void
 freerange(void *pa_start, void *pa_end)
 {
-  char *p;
-  p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  uint64 p;
+  int order;
+
+  p = PGROUNDUP((uint64)pa_start);
+  acquire(&buddy.lock);
+  while(p + PGSIZE <= (uint64)pa_end){
+    order = 0;
+    while(order < MAXORDER && PA2REF(p) % (2 << order) == 0 &&
+          p + (PGSIZE << (order+1)) <= (uint64)pa_end)
+      order++;
+    // Fill with junk to catch dangling refs.
+    memset((void*)p, 1, PGSIZE << order);
+    buddyfree(p, order);
+    npages += 1 << order;
+    p += PGSIZE << order;
+  }
+  release(&buddy.lock);
 }
 
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
-void
-kfree(void *pa)
+static void
+buddypush(int i, int order)
 {
-  struct run *r;
+  struct run *r = (struct run*)REF2PA(i);
+
+  r->prev = 0;
+  r->next = buddy.freelist[order];
+  if(r->next)
+    r->next->prev = r;
+  buddy.freelist[order] = r;
+  buddy.nfree[order]++;
+  buddy.order[i] = order + 1;
+}
+
+static void
+buddyunlink(int i, int order)
+{
+  struct run *r = (struct run*)REF2PA(i);
+
+  if(r->prev)
+    r->prev->next = r->next;
+  else
+    buddy.freelist[order] = r->next;
+  if(r->next)
+    r->next->prev = r->prev;
+  buddy.nfree[order]--;
+  buddy.order[i] = 0;
+}
+
+// Give the block of 2^order pages at pa to the buddy
+// allocator, merging it with its buddy for as long as
+// that is free. Caller must hold buddy.lock.
+static void
+buddyfree(uint64 pa, int order)
+{
+  int i, b;
+
+  i = PA2REF(pa);
+  while(order < MAXORDER){
+    b = i ^ (1 << order);
+    if(b >= NPAGES || buddy.order[b] != order + 1)
+      break;
+    buddyunlink(b, order);
+    i &= ~(1 << order);
+    order++;
+  }
+  buddypush(i, order);
+}
+
+// Take a block of 2^order pages from the buddy allocator,
+// splitting a larger one if need be. Returns its address,
+// or 0. Caller must hold buddy.lock.
+static uint64
+buddyalloc(int order)
+{
+  int i, k;
+
+  for(k = order; k <= MAXORDER && buddy.freelist[k] == 0; k++)
+    ;
+  if(k > MAXORDER)
+    return 0;
+  i = PA2REF(buddy.freelist[k]);
+  buddyunlink(i, k);
+  while(k > order){
+    k--;
+    buddypush(i + (1 << k), k);
+  }
+  return REF2PA(i);
+}
+
+// Put page pa on km's free list, handing a batch back to
+// the buddy allocator if the list has grown too long.
+static void
+kfree1(struct kmem *km, void *pa)
+{
+  struct run *r, *batch;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
@@ -56,10 +198,126 @@ kfree(void *pa)
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  acquire(&km->lock);
+  r->next = km->freelist;
+  km->freelist = r;
+  km->nfree++;
+  batch = 0;
+  if(km->nfree > KCACHE){
+    batch = km->freelist;
+    for(int i = 0; i < KBATCH; i++){
+      r = km->freelist;
+      km->freelist = r->next;
+    }
+    r->next = 0;
+    km->nfree -= KBATCH;
+  }
+  release(&km->lock);
+
+  if(batch){
+    acquire(&buddy.lock);
+    for(r = batch; r; r = batch){
+      batch = r->next;
+      buddyfree((uint64)r, 0);
+    }
+    release(&buddy.lock);
+  }
+}
+
+// Drop a reference to the page of physical memory pointed
+// at by pa, which should have been returned by a call to
+// kalloc(), and free the page when that was the last one.
+void
+kfree(void *pa)
+{
+  if((char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kfree");
+
+  int ref = __sync_sub_and_fetch(&kref[PA2REF(pa)], 1);
+  if(ref < 0)
+    panic("kfree: ref");
+  if(ref > 0)
+    return;
+
+  push_off();
+  kfree1(&kmem[cpuid()], pa);
+  pop_off();
+}
+
+// Refill CPU id's cache with up to KBATCH pages from the
+// buddy allocator, keeping one page for the caller.
+// Caller must have interrupts off.
+static struct run*
+krefill(int id)
+{
+  struct run *r, *list;
+  uint64 pa;
+  int n;
+
+  list = 0;
+  acquire(&buddy.lock);
+  for(n = 0; n < KBATCH && (pa = buddyalloc(0)) != 0; n++){
+    r = (struct run*)pa;
+    r->next = list;
+    list = r;
+  }
+  release(&buddy.lock);
+  if(list == 0)
+    return 0;
+
+  acquire(&kmem[id].lock);
+  for(r = list->next; r; r = list->next){
+    list->next = r->next;
+    r->next = kmem[id].freelist;
+    kmem[id].freelist = r;
+  }
+  kmem[id].nfree += n - 1;
+  kmem[id].nrefill++;
+  release(&kmem[id].lock);
+  return list;
+}
+
+// Take up to NSTEAL pages from some other CPU's free list.
+// Keeps one page for the caller and adds the rest to
+// this CPU's list. Only one kmem lock is held at a time,
+// so two CPUs stealing from each other can't deadlock.
+// Caller must have interrupts off.
+static struct run*
+ksteal(int id)
+{
+  struct run *r, *last;
+  int i, n;
+
+  for(i = 1; i < NCPU; i++){
+    struct kmem *victim = &kmem[(id + i) % NCPU];
+
+    acquire(&victim->lock);
+    r = victim->freelist;
+    if(r == 0){
+      release(&victim->lock);
+      continue;
+    }
+    // take half of the victim's pages, up to NSTEAL.
+    n = (victim->nfree + 1) / 2;
+    if(n > NSTEAL)
+      n = NSTEAL;
+    last = r;
+    for(int j = 1; j < n; j++)
+      last = last->next;
+    victim->freelist = last->next;
+    victim->nfree -= n;
+    release(&victim->lock);
+
+    acquire(&kmem[id].lock);
+    last->next = kmem[id].freelist;
+    kmem[id].freelist = r->next;
+    kmem[id].nfree += n - 1;
+    kmem[id].nsteal++;
+    kmem[id].nstolen += n;
+    release(&kmem[id].lock);
+    return r;
+  }
+  return 0;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -69,14 +327,155 @@ void *
 kalloc(void)
 {
   struct run *r;
+  int id;
+
+  push_off();
+  id = cpuid();
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  acquire(&kmem[id].lock);
+  r = kmem[id].freelist;
+  if(r){
+    kmem[id].freelist = r->next;
+    kmem[id].nfree--;
+    kmem[id].nhit++;
+  }
+  release(&kmem[id].lock);
 
-  if(r)
+  if(r == 0)
+    r = krefill(id);
+  if(r == 0)
+    r = ksteal(id);
+  pop_off();
+
+  if(r){
     memset((char*)r, 5, PGSIZE); // fill with junk
+    kref[PA2REF(r)] = 1;
+  }
   return (void*)r;
 }
+
+// Allocate a block of 2^order physically contiguous pages,
+// aligned to its size. Returns 0 if there is no free block
+// that large. Each page has a reference count of 1, as if
+// from kalloc(), so the pages may later be freed one at a
+// time. A block of more than one page is not filled with
+// junk; its callers clear it anyway.
+void *
+kalloc_pages(int order)
+{
+  uint64 pa;
+
+  if(order < 0 || order > MAXORDER)
+    panic("kalloc_pages");
+  if(order == 0)
+    return kalloc();
+
+  acquire(&buddy.lock);
+  pa = buddyalloc(order);
+  if(pa)
+    buddy.nalloc[order]++;
+  else
+    buddy.nfail[order]++;
+  release(&buddy.lock);
+
+  if(pa){
+    for(int i = 0; i < (1 << order); i++)
+      kref[PA2REF(pa) + i] = 1;
+  }
+  return (void*)pa;
+}
+
+// Drop a reference to each page of the block of 2^order
+// pages at pa. If they were the last references, the block
+// goes back to the buddy allocator whole; otherwise each
+// page is freed as by kfree().
+void
+kfree_pages(void *pa, int order)
+{
+  int i, n = 1 << order;
+
+  if(order < 0 || order > MAXORDER || ((uint64)pa % (PGSIZE << order)) != 0 ||
+     (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kfree_pages");
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+
+  // only a holder of the last references can see them all
+  // at 1, and no one else can then take new ones.
+  for(i = 0; i < n; i++){
+    if(kref[PA2REF(pa) + i] != 1)
+      break;
+  }
+  if(i < n){
+    for(i = 0; i < n; i++)
+      kfree((char*)pa + i*PGSIZE);
+    return;
+  }
+  for(i = 0; i < n; i++)
+    kref[PA2REF(pa) + i] = 0;
+
+  // Fill with junk to catch dangling refs.
+  memset(pa, 1, PGSIZE << order);
+
+  acquire(&buddy.lock);
+  buddyfree((uint64)pa, order);
+  release(&buddy.lock);
+}
+
+// Add a reference to the allocated page pa.
+void
+krefinc(void *pa)
+{
+  if((char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("krefinc");
+  if(__sync_fetch_and_add(&kref[PA2REF(pa)], 1) < 1)
+    panic("krefinc: free page");
+}
+
+// Return the number of references to the allocated page pa.
+int
+krefcnt(void *pa)
+{
+  return kref[PA2REF(pa)];
+}
+
+// Fill in *st, for the memstat() system call.
+void
+kmemstat(struct memstat *st)
+{
+  memset(st, 0, sizeof(*st));
+  st->npages = npages;
+  acquire(&buddy.lock);
+  for(int k = 0; k <= MAXORDER; k++){
+    st->nfree[k] = buddy.nfree[k];
+    st->nalloc[k] = buddy.nalloc[k];
+    st->nfail[k] = buddy.nfail[k];
+  }
+  release(&buddy.lock);
+  for(int i = 0; i < NCPU; i++){
+    acquire(&kmem[i].lock);
+    st->ncached += kmem[i].nfree;
+    release(&kmem[i].lock);
+  }
+}
+
+// Print allocator statistics to the console.
+// Runs when user types ^P on console.
+// No lock to avoid wedging a stuck machine further.
+void
+kmemdump(void)
+{
+  for(int i = 0; i < NCPU; i++){
+    struct kmem *km = &kmem[i];
+    if(km->nhit == 0 && km->nsteal == 0 && km->nrefill == 0)
+      continue;
+    printf("kmem cpu %d: free %d hit %d refill %d steal %d stolen %d\n",
+           i, km->nfree, km->nhit, km->nrefill, km->nsteal, km->nstolen);
+  }
+  printf("buddy free:");
+  for(int k = 0; k <= MAXORDER; k++)
+    printf(" %d", buddy.nfree[k]);
+  printf("\n");
+}
@@ -9,31 +9,50 @@
 
 // Simple logging that allows concurrent FS system calls.
 //
-// A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
-// any reasoning required about whether a commit might
-// write an uncommitted system call's updates to disk.
+// A log transaction ("group") contains the updates of multiple
+// FS system calls. A group is closed when none of its system
+// calls is active any more. Thus there is never any reasoning
+// required about whether a commit might write an uncommitted
+// system call's updates to the log.
 //
 // A system call should call begin_op()/end_op() to mark
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the group has been closed.
+//
+// Commits are asynchronous with respect to other system
+// calls: the closed group's blocks are copied into a private
+// snapshot, and from then on new system calls join the next
+// group while the snapshot is written to the log, committed
+// and installed. Only one group is committed at a time.
 //
 // The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
+// It is split into two regions that commits alternate
+// between, so one region can still describe the previous
+// group while the next is being written to the other.
+// The on-disk format of a region:
+//   header block, containing a sequence number and
+//     block #s for block A, B, C, ...
 //   block A
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// Installation copies blocks from the cache, which may by
+// then hold changes of the (uncommitted) next group. So a
+// region's header is only erased once the group after it has
+// committed; until then recovery replays both regions, oldest
+// first. The blocks of a commit are handed to the disk
+// NBATCH at a time so it can work on them concurrently.
+
+// max blocks install_trans() writes at once.
+#define NBATCH 8
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
   int n;
+  int seq;
   int block[LOGSIZE];
 };
 
@@ -41,13 +60,29 @@ struct log {
   struct spinlock lock;
   int start;
   int size;
+  int cap;         // max blocks in one group
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int freezing;    // snapshotting the closed group, please wait.
+  int committing;  // some process is in commit().
+  int region;      // region the open group will be written to.
+  int seq;         // sequence number of the next commit.
+  int dirty;       // region of an installed group not yet erased, or -1.
   int dev;
-  struct logheader lh;
+  struct logheader lh; // the open group
 };
 struct log log;
 
+// The group being committed, and a snapshot of its blocks.
+// Only used by the process in commit(), or by recovery. The
+// snapshot buffers are not in the buffer cache; they are
+// read and written with the disk driver directly.
+static struct logheader clh;
+static struct buf logbuf[LOGSIZE];
+static struct buf headbuf;
+
+// First block of log region r.
+#define REGION(r) (log.start + (r)*(log.size/2))
+
 static void recover_from_log(void);
 static void commit();
 
@@ -61,64 +96,123 @@ initlog(int dev, struct superblock *sb)
   log.start = sb->logstart;
   log.size = sb->nlog;
   log.dev = dev;
+  log.cap = log.size/2 - 1;
+  if(log.cap > LOGSIZE)
+    log.cap = LOGSIZE;
+  if(log.cap < MAXOPBLOCKS)
+    panic("initlog: log too small");
+  log.dirty = -1;
   recover_from_log();
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks to their home location.
+// After a commit the cached blocks already hold the logged
+// data (or newer data), so the log snapshot only needs to be
+// copied when recovering.
 static void
-install_trans(void)
+install_trans(struct logheader *lh, int recovering)
 {
-  int tail;
-
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  struct buf *dbuf[NBATCH];
+  int tail, i, n;
+
+  for (tail = 0; tail < lh->n; tail += n) {
+    n = lh->n - tail;
+    if(n > NBATCH)
+      n = NBATCH;
+    for (i = 0; i < n; i++) {
+      dbuf[i] = bread(log.dev, lh->block[tail+i]); // read dst
+      if(recovering)
+        memmove(dbuf[i]->data, logbuf[tail+i].data, BSIZE);  // copy block to dst
+    }
+    bwritev(dbuf, n);  // write dsts to disk
+    for (i = 0; i < n; i++) {
+      if(recovering == 0)
+        bunpin(dbuf[i]);
+      brelse(dbuf[i]);
+    }
   }
 }
 
-// Read the log header from disk into the in-memory log header
+// Read or write the first n snapshot buffers from or to
+// the data blocks of log region r.
 static void
-read_head(void)
+rw_log(int r, int n, int write)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
+  struct buf *b[LOGSIZE];
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+
+  for (i = 0; i < n; i++) {
+    logbuf[i].dev = log.dev;
+    logbuf[i].blockno = REGION(r) + 1 + i;
+    b[i] = &logbuf[i];
   }
-  brelse(buf);
+  virtio_disk_rwv(b, n, write);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Read the header of log region r from disk.
 static void
-write_head(void)
+read_head(int r, struct logheader *lh)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
+  struct logheader *hb = (struct logheader *) (headbuf.data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+
+  headbuf.dev = log.dev;
+  headbuf.blockno = REGION(r);
+  virtio_disk_rw(&headbuf, 0);
+  lh->n = hb->n;
+  lh->seq = hb->seq;
+  if (lh->n < 0 || lh->n > log.cap)
+    panic("read_head");
+  for (i = 0; i < lh->n; i++) {
+    lh->block[i] = hb->block[i];
   }
-  bwrite(buf);
-  brelse(buf);
+}
+
+// Write lh to the header of log region r, or erase the
+// region if lh is 0. Writing a non-empty header is the
+// true point at which a group commits.
+static void
+write_head(int r, struct logheader *lh)
+{
+  struct logheader *hb = (struct logheader *) (headbuf.data);
+  int i;
+
+  memset(headbuf.data, 0, BSIZE);
+  if (lh) {
+    hb->n = lh->n;
+    hb->seq = lh->seq;
+    for (i = 0; i < lh->n; i++) {
+      hb->block[i] = lh->block[i];
+    }
+  }
+  headbuf.dev = log.dev;
+  headbuf.blockno = REGION(r);
+  virtio_disk_rw(&headbuf, 1);
 }
 
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  struct logheader lh[2];
+  int r, first;
+
+  read_head(0, &lh[0]);
+  read_head(1, &lh[1]);
+  // replay committed regions oldest first.
+  first = (lh[0].n > 0 && lh[1].n > 0 && lh[1].seq < lh[0].seq);
+  for (r = first; r < first + 2; r++) {
+    struct logheader *h = &lh[r % 2];
+    if (h->n == 0)
+      continue;
+    rw_log(r % 2, h->n, 0);
+    install_trans(h, 1);
+    if (h->seq >= log.seq)
+      log.seq = h->seq + 1;
+  }
+  for (r = 0; r < 2; r++) {
+    if (lh[r].n > 0)
+      write_head(r, 0); // clear the log
+  }
 }
 
 // called at the start of each FS system call.
@@ -127,9 +221,9 @@ begin_op(void)
 {
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.freezing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > log.cap){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
     } else {
@@ -141,7 +235,10 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// commits the group if this was its last outstanding
+// operation, unless another process is still committing
+// the previous group; that process will commit this one
+// when it is done.
 void
 end_op(void)
 {
@@ -149,11 +246,10 @@ end_op(void)
 
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
+  if(log.outstanding == 0 && log.lh.n > 0 && !log.committing){
     do_commit = 1;
     log.committing = 1;
+    log.freezing = 1;
   } else {
     // begin_op() may be waiting for log space,
     // and decrementing log.outstanding has decreased
@@ -166,44 +262,65 @@ end_op(void)
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
     commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Copy the closed group's blocks from cache to the snapshot.
 static void
-write_log(void)
+snapshot(void)
 {
-  int tail;
+  int i;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+  for (i = 0; i < log.lh.n; i++) {
+    struct buf *from = bread(log.dev, log.lh.block[i]); // cache block
+    memmove(logbuf[i].data, from->data, BSIZE);
     brelse(from);
-    brelse(to);
   }
 }
 
+// Commit closed groups until the open one is still in use
+// or empty. Called with log.committing and log.freezing set.
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(); // Now install writes to home locations
+  int r;
+
+  for(;;){
+    snapshot();      // Copy modified blocks while no op can change them
+
+    acquire(&log.lock);
+    clh = log.lh;
+    clh.seq = log.seq++;
     log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+    r = log.region;
+    log.region ^= 1;
+    log.freezing = 0;
+    wakeup(&log);    // the next group may start
+    release(&log.lock);
+
+    rw_log(r, clh.n, 1);  // Write snapshot to log
+    write_head(r, &clh);  // Write header to disk -- the real commit
+    if(log.dirty >= 0)
+      write_head(log.dirty, 0); // Erase the previous group, now covered by this one
+    install_trans(&clh, 0);     // Now install writes to home locations
+    log.dirty = r;
+
+    acquire(&log.lock);
+    if(log.outstanding == 0 && log.lh.n > 0){
+      log.freezing = 1;
+      release(&log.lock);
+      continue;
+    }
+    log.committing = 0;
+    wakeup(&log);
+    release(&log.lock);
+    return;
   }
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// commit() will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -215,7 +332,7 @@ log_write(struct buf *b)
 {
   int i;
 
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= log.cap)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
@@ -232,4 +349,3 @@ log_write(struct buf *b)
   }
   release(&log.lock);
 }
-
@@ -22,10 +22,12 @@ main()
     procinit();      // process table
     trapinit();      // trap vectors
     trapinithart();  // install kernel trap vector
+    timer_init();    // kernel timers
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
     iinit();         // inode cache
+    dcacheinit();    // directory entry cache
     fileinit();      // file table
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
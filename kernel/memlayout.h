@@ -29,6 +29,8 @@
 #define CLINT 0x2000000L
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
+#define CLINT_FREQ 10000000 // mtime cycles per second in qemu.
+#define CLINT_INTERVAL (CLINT_FREQ/10) // cycles between clock ticks.
 
 // qemu puts programmable interrupt controller here.
 #define PLIC 0x0c000000L
@@ -0,0 +1,8 @@
+// Physical memory allocator statistics, from memstat().
+struct memstat {
+  int npages;               // pages of RAM the allocator manages
+  int ncached;              // free pages in per-CPU caches
+  int nfree[MAXORDER+1];    // free blocks of 2^k pages
+  int nalloc[MAXORDER+1];   // multi-page allocations that succeeded
+  int nfail[MAXORDER+1];    // and that found no free block
+};
@@ -0,0 +1,281 @@
+//
+// Memory-mapped files.
+//
+// mmap() only records the mapping in a free slot of the
+// process's vma[] table; pages are read in from the file by
+// mmapfault() when the process first touches them. Dirty
+// pages of MAP_SHARED mappings are written back to the file
+// when they are unmapped by munmap(), exec() or exit().
+// Mappings are placed top-down below the trapframe.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "fs.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+#include "proc.h"
+
+// Return the mapping of p that contains va, or 0.
+static struct vma*
+vmalookup(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->used && va >= v->addr && va < v->addr + v->len)
+      return v;
+  }
+  return 0;
+}
+
+// Lowest address used by any mapping of p; the heap
+// must stay below it.
+uint64
+mmaplow(struct proc *p)
+{
+  struct vma *v;
+  uint64 low = TRAPFRAME;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->used && v->addr < low)
+      low = v->addr;
+  }
+  return low;
+}
+
+// Map len bytes of file f, starting at offset off, into
+// the current process. Returns the address of the mapping,
+// or -1 on error.
+uint64
+mmap(uint64 len, int prot, int flags, struct file *f, uint off)
+{
+  struct proc *p = myproc();
+  struct vma *v, *free;
+  uint64 low;
+
+  if(len == 0 || len > MAXVA || off % PGSIZE != 0)
+    return -1;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if(f->type != FD_INODE || !f->readable)
+    return -1;
+  if(flags == MAP_SHARED && (prot & PROT_WRITE) && !f->writable)
+    return -1;
+
+  free = 0;
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(!v->used){
+      free = v;
+      break;
+    }
+  }
+  if(free == 0)
+    return -1;
+
+  len = PGROUNDUP(len);
+  low = mmaplow(p);
+  if(len > low || low - len < PGROUNDUP(p->sz))
+    return -1;
+
+  v = free;
+  v->used = 1;
+  v->addr = low - len;
+  v->len = len;
+  v->prot = prot;
+  v->flags = flags;
+  v->f = filedup(f);
+  v->off = off;
+  return v->addr;
+}
+
+// Read in the page of the mapping that contains va.
+// Returns the physical address of the page, or 0 if va is
+// not mapped, the access is not allowed by the mapping's
+// protection, or memory is exhausted.
+// Must not be called with a spinlock held, since it reads
+// the file.
+uint64
+mmapfault(struct proc *p, uint64 va, int write)
+{
+  struct vma *v;
+  char *mem;
+  int perm;
+
+  va = PGROUNDDOWN(va);
+  if((v = vmalookup(p, va)) == 0)
+    return 0;
+  if(write && (v->prot & PROT_WRITE) == 0)
+    return 0;
+  if((v->prot & (PROT_READ|PROT_WRITE|PROT_EXEC)) == 0)
+    return 0;
+
+  if((mem = kalloc()) == 0)
+    return 0;
+  memset(mem, 0, PGSIZE);
+  ilock(v->f->ip);
+  readi(v->f->ip, 0, (uint64)mem, v->off + (va - v->addr), PGSIZE);
+  iunlock(v->f->ip);
+
+  // RISC-V has no write-only pages, so PROT_WRITE implies
+  // PROT_READ.
+  perm = PTE_U;
+  if(v->prot & (PROT_READ|PROT_WRITE))
+    perm |= PTE_R;
+  if(v->prot & PROT_WRITE)
+    perm |= PTE_W;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+  if(write)
+    perm |= PTE_D;
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    kfree(mem);
+    return 0;
+  }
+  return (uint64)mem;
+}
+
+// Fault in any not-yet-present mapped pages in the user
+// range [va, va+n), so that copyin()/copyout() on that range
+// won't have to read the file, perhaps while holding a
+// spinlock or the lock of the very inode being read.
+// Returns -1 if a page can't be faulted in, since a later
+// fault would then try again with those locks held.
+int
+mmapprefault(struct proc *p, uint64 va, uint64 n, int write)
+{
+  struct vma *v;
+  uint64 a, start, end;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(!v->used || va + n <= v->addr || va >= v->addr + v->len)
+      continue;
+    start = va > v->addr ? PGROUNDDOWN(va) : v->addr;
+    end = va + n < v->addr + v->len ? va + n : v->addr + v->len;
+    for(a = start; a < end; a += PGSIZE){
+      if(walkaddr(p->pagetable, a) == 0 && mmapfault(p, a, write) == 0)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+// Unmap the pages of v in [va, va+len), writing dirty pages
+// of a shared mapping back to the file. Never grows the file.
+static void
+vmaunmap(struct proc *p, struct vma *v, uint64 va, uint64 len)
+{
+  struct inode *ip = v->f->ip;
+  uint64 a, pa;
+  uint off, n;
+  pte_t *pte;
+
+  for(a = va; a < va + len; a += PGSIZE){
+    if((pa = walkaddr(p->pagetable, a)) == 0)
+      continue;
+    pte = walk(p->pagetable, a, 0);
+    if(v->flags == MAP_SHARED && (*pte & PTE_D)){
+      off = v->off + (a - v->addr);
+      begin_op();
+      ilock(ip);
+      if(off < ip->size){
+        n = ip->size - off;
+        if(n > PGSIZE)
+          n = PGSIZE;
+        writei(ip, 0, pa, off, n);
+      }
+      iunlock(ip);
+      end_op();
+    }
+    uvmunmap(p->pagetable, a, 1, 1);
+  }
+}
+
+// Remove [addr, addr+len) from the current process's
+// mappings. The range must be at the start or the end of a
+// single mapping (or all of it). Returns 0 or -1.
+int
+munmap(uint64 addr, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+
+  if(addr % PGSIZE != 0 || len == 0)
+    return -1;
+  len = PGROUNDUP(len);
+  if((v = vmalookup(p, addr)) == 0 || addr + len > v->addr + v->len)
+    return -1;
+  if(addr != v->addr && addr + len != v->addr + v->len)
+    return -1;  // would punch a hole
+
+  vmaunmap(p, v, addr, len);
+
+  if(len == v->len){
+    fileclose(v->f);
+    v->used = 0;
+    v->f = 0;
+  } else if(addr == v->addr){
+    v->addr += len;
+    v->off += len;
+    v->len -= len;
+  } else {
+    v->len -= len;
+  }
+  return 0;
+}
+
+// Remove all of p's mappings; for exit() and exec().
+void
+munmapall(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(!v->used)
+      continue;
+    vmaunmap(p, v, v->addr, v->len);
+    fileclose(v->f);
+    v->used = 0;
+    v->f = 0;
+  }
+}
+
+// Give child np copies of p's mappings, sharing the pages
+// that are present: MAP_SHARED pages outright, MAP_PRIVATE
+// pages copy-on-write. Returns 0, or -1 with nothing mapped
+// into np.
+int
+mmapcopy(struct proc *p, struct proc *np)
+{
+  int i, j;
+
+  for(i = 0; i < NVMA; i++){
+    struct vma *v = &p->vma[i];
+    if(!v->used)
+      continue;
+    if(uvmshare(p->pagetable, np->pagetable, v->addr, v->len,
+                v->flags == MAP_PRIVATE) < 0)
+      goto bad;
+    np->vma[i] = *v;
+  }
+  for(i = 0; i < NVMA; i++){
+    if(np->vma[i].used)
+      filedup(np->vma[i].f);
+  }
+  return 0;
+
+ bad:
+  for(j = 0; j < i; j++){
+    struct vma *v = &np->vma[j];
+    if(!v->used)
+      continue;
+    uvmunmap(np->pagetable, v->addr, v->len / PGSIZE, 1);
+    v->used = 0;
+  }
+  return -1;
+}
@@ -1,13 +1,17 @@
 #define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NVMA         16  // memory-mapped regions per process
+#define NSEG          4  // loadable program segments per process
+#define NINODE       50  // unused i-nodes kept in memory
+#define NDENTRY     512  // cached directory entries
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in one log region
+#define NBUF         (MAXOPBLOCKS*8)  // initial size of disk block cache
+#define FSSIZE       (7*8192)  // size of file system in blocks; see mkfs.c
+#define PIPEPAGES    4  // pages of buffer per pipe; a power of 2
+#define MAXORDER    10  // largest kalloc_pages() block is 2^MAXORDER pages
 #define MAXPATH      128   // maximum file path name
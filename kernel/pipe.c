@@ -8,17 +8,42 @@
 #include "sleeplock.h"
 #include "file.h"
 
-#define PIPESIZE 512
+// The buffer is a ring of PIPEPAGES separately allocated
+// pages. Data is copied to and from user space a contiguous
+// span at a time, and sleepers are only woken when the pipe
+// goes from empty to non-empty (readers) or from full to
+// non-full (writers), since those are the only states in
+// which anyone sleeps.
+//
+// splice() moves data between a pipe and a file without
+// going through user memory: pipewbegin()/pipewend() and
+// piperbegin()/piperend() let file.c read or write a span
+// of the buffer in place, with the pipe lock released so the
+// file system can sleep. While a span is out, the busy flag
+// keeps other writers (or readers) off that end of the pipe.
+#define PIPESIZE (PIPEPAGES*PGSIZE)
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *buf[PIPEPAGES];
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
+  int rbusy;      // piperbegin() span is out
+  int wbusy;      // pipewbegin() span is out
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
 };
 
+static void
+pipefree(struct pipe *pi)
+{
+  for(int i = 0; i < PIPEPAGES; i++){
+    if(pi->buf[i])
+      kfree(pi->buf[i]);
+  }
+  kfree((char*)pi);
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -30,10 +55,18 @@ pipealloc(struct file **f0, struct file **f1)
     goto bad;
   if((pi = (struct pipe*)kalloc()) == 0)
     goto bad;
+  for(int i = 0; i < PIPEPAGES; i++)
+    pi->buf[i] = 0;
+  for(int i = 0; i < PIPEPAGES; i++){
+    if((pi->buf[i] = kalloc()) == 0)
+      goto bad;
+  }
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
   pi->nread = 0;
+  pi->rbusy = 0;
+  pi->wbusy = 0;
   initlock(&pi->lock, "pipe");
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
@@ -47,7 +80,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    pipefree(pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -68,33 +101,58 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    pipefree(pi);
   } else
     release(&pi->lock);
 }
 
+// Return the length of the contiguous span of the buffer
+// starting at ring offset off, limited to n bytes.
+static int
+pipespan(uint off, int n)
+{
+  int m = PGSIZE - off % PGSIZE;
+  return n < m ? n : m;
+}
+
+// Return the address in the buffer of ring offset off.
+static char*
+pipeaddr(struct pipe *pi, uint off)
+{
+  return pi->buf[(off % PIPESIZE) / PGSIZE] + off % PGSIZE;
+}
+
 int
 pipewrite(struct pipe *pi, uint64 addr, int n)
 {
-  int i;
-  char ch;
+  int i, m;
   struct proc *pr = myproc();
 
   acquire(&pi->lock);
-  for(i = 0; i < n; i++){
-    while(pi->nwrite == pi->nread + PIPESIZE){  //DOC: pipewrite-full
+  i = 0;
+  while(i < n){
+    if(pi->wbusy){
+      sleep(&pi->wbusy, &pi->lock);
+      continue;
+    }
+    if(pi->nwrite == pi->nread + PIPESIZE){  //DOC: pipewrite-full
       if(pi->readopen == 0 || pr->killed){
         release(&pi->lock);
         return -1;
       }
-      wakeup(&pi->nread);
       sleep(&pi->nwrite, &pi->lock);
+      continue;
     }
-    if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+    m = pipespan(pi->nwrite, n - i);
+    if(m > PIPESIZE - (pi->nwrite - pi->nread))
+      m = PIPESIZE - (pi->nwrite - pi->nread);
+    if(copyin(pr->pagetable, pipeaddr(pi, pi->nwrite), addr + i, m) == -1)
       break;
-    pi->data[pi->nwrite++ % PIPESIZE] = ch;
+    if(pi->nwrite == pi->nread)
+      wakeup(&pi->nread);  // no longer empty
+    pi->nwrite += m;
+    i += m;
   }
-  wakeup(&pi->nread);
   release(&pi->lock);
   return i;
 }
@@ -102,26 +160,131 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
 int
 piperead(struct pipe *pi, uint64 addr, int n)
 {
-  int i;
+  int i, m;
   struct proc *pr = myproc();
-  char ch;
 
   acquire(&pi->lock);
-  while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
+  while((pi->nread == pi->nwrite && pi->writeopen) || pi->rbusy){  //DOC: pipe-empty
     if(pr->killed){
       release(&pi->lock);
       return -1;
     }
-    sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
+    if(pi->rbusy)
+      sleep(&pi->rbusy, &pi->lock);
+    else
+      sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
-      break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+  i = 0;
+  while(i < n && pi->nread != pi->nwrite){  //DOC: piperead-copy
+    m = pipespan(pi->nread, n - i);
+    if(m > pi->nwrite - pi->nread)
+      m = pi->nwrite - pi->nread;
+    if(copyout(pr->pagetable, addr + i, pipeaddr(pi, pi->nread), m) == -1)
       break;
+    if(pi->nwrite == pi->nread + PIPESIZE)
+      wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+    pi->nread += m;
+    i += m;
   }
-  wakeup(&pi->nwrite);  //DOC: piperead-wakeup
   release(&pi->lock);
   return i;
 }
+
+// Wait for room in the pipe, and return in *addr the start
+// of a contiguous free span of at most n bytes. Returns the
+// span's length, or -1 if the read end is closed or the
+// process is killed. The caller fills the span without the
+// pipe lock, then calls pipewend().
+int
+pipewbegin(struct pipe *pi, int n, char **addr)
+{
+  int m;
+  struct proc *pr = myproc();
+
+  acquire(&pi->lock);
+  while(pi->wbusy || pi->nwrite == pi->nread + PIPESIZE){
+    if(pi->readopen == 0 || pr->killed){
+      release(&pi->lock);
+      return -1;
+    }
+    if(pi->wbusy)
+      sleep(&pi->wbusy, &pi->lock);
+    else
+      sleep(&pi->nwrite, &pi->lock);
+  }
+  pi->wbusy = 1;
+  m = pipespan(pi->nwrite, n);
+  if(m > PIPESIZE - (pi->nwrite - pi->nread))
+    m = PIPESIZE - (pi->nwrite - pi->nread);
+  *addr = pipeaddr(pi, pi->nwrite);
+  release(&pi->lock);
+  return m;
+}
+
+// Add the first m bytes of the span from pipewbegin() to
+// the pipe.
+void
+pipewend(struct pipe *pi, int m)
+{
+  acquire(&pi->lock);
+  if(m > 0){
+    if(pi->nwrite == pi->nread)
+      wakeup(&pi->nread);  // no longer empty
+    pi->nwrite += m;
+  }
+  pi->wbusy = 0;
+  wakeup(&pi->wbusy);
+  release(&pi->lock);
+}
+
+// Return in *addr the start of a contiguous span of at most
+// n buffered bytes. If the pipe is empty, waits for data if
+// wait is set and a writer remains. Returns the span's
+// length, 0 if there is nothing to read, or -1 if the
+// process is killed. Unless 0 or -1 is returned, the caller
+// copies out of the span without the pipe lock, then calls
+// piperend().
+int
+piperbegin(struct pipe *pi, int n, char **addr, int wait)
+{
+  int m;
+  struct proc *pr = myproc();
+
+  acquire(&pi->lock);
+  while(pi->rbusy || (pi->nread == pi->nwrite && pi->writeopen && wait)){
+    if(pr->killed){
+      release(&pi->lock);
+      return -1;
+    }
+    if(pi->rbusy)
+      sleep(&pi->rbusy, &pi->lock);
+    else
+      sleep(&pi->nread, &pi->lock);
+  }
+  if(pi->nread == pi->nwrite){
+    release(&pi->lock);
+    return 0;
+  }
+  pi->rbusy = 1;
+  m = pipespan(pi->nread, n);
+  if(m > pi->nwrite - pi->nread)
+    m = pi->nwrite - pi->nread;
+  *addr = pipeaddr(pi, pi->nread);
+  release(&pi->lock);
+  return m;
+}
+
+// Consume the first m bytes of the span from piperbegin().
+void
+piperend(struct pipe *pi, int m)
+{
+  acquire(&pi->lock);
+  if(m > 0){
+    if(pi->nwrite == pi->nread + PIPESIZE)
+      wakeup(&pi->nwrite);  // no longer full
+    pi->nread += m;
+  }
+  pi->rbusy = 0;
+  wakeup(&pi->rbusy);
+  release(&pi->lock);
+}
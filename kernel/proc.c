@@ -15,9 +15,24 @@ struct proc *initproc;
 int nextpid = 1;
 struct spinlock pid_lock;
 
+// Sleeping processes, hashed by wait channel, so that
+// wakeup() only looks at processes that might be sleeping
+// on its channel. A process is in the queue of p->chan
+// from sleep() until it is made RUNNABLE again.
+// Lock order: p->lock, then a wait queue lock.
+#define NSLEEPQ 31
+#define SQHASH(chan) (((uint64)(chan) >> 2) % NSLEEPQ)
+
+struct sleepq {
+  struct spinlock lock;
+  struct proc *head;
+} sleepq[NSLEEPQ];
+
 extern void forkret(void);
 static void wakeup1(struct proc *chan);
 static void freeproc(struct proc *p);
+static void runqput(struct proc *p);
+static void wakeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
 
@@ -28,6 +43,10 @@ procinit(void)
   struct proc *p;
   
   initlock(&pid_lock, "nextpid");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&cpus[i].rqlock, "runq");
+  for(int i = 0; i < NSLEEPQ; i++)
+    initlock(&sleepq[i].lock, "sleepq");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
 
@@ -149,6 +168,7 @@ freeproc(struct proc *p)
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  memset(p->seg, 0, sizeof(p->seg));
   p->state = UNUSED;
 }
 
@@ -228,26 +248,38 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  runqput(p);
 
   release(&p->lock);
 }
 
 // Grow or shrink user memory by n bytes.
+// Growing only moves p->sz; pages are allocated
+// by vmfault() when they are first touched.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
 {
-  uint sz;
+  uint64 sz;
   struct proc *p = myproc();
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    if(sz + n > mmaplow(p))
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
     sz = uvmdealloc(p->pagetable, sz, sz + n);
+    if(sz == p->sz)
+      return -1;
+    // memory given back is no longer part of the program.
+    for(struct seg *s = p->seg; s < &p->seg[NSEG]; s++){
+      if(s->memsz == 0 || s->va + s->memsz <= sz)
+        continue;
+      s->memsz = sz > s->va ? sz - s->va : 0;
+      if(s->filesz > s->memsz)
+        s->filesz = s->memsz;
+    }
   }
   p->sz = sz;
   return 0;
@@ -275,6 +307,13 @@ fork(void)
   }
   np->sz = p->sz;
 
+  // Share memory-mapped files.
+  if(mmapcopy(p, np) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+
   np->parent = p;
 
   // copy saved user registers.
@@ -288,12 +327,14 @@ fork(void)
     if(p->ofile[i])
       np->ofile[i] = filedup(p->ofile[i]);
   np->cwd = idup(p->cwd);
+  np->exe = p->exe ? idup(p->exe) : 0;
+  memmove(np->seg, p->seg, sizeof(p->seg));
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
   pid = np->pid;
 
-  np->state = RUNNABLE;
+  runqput(np);
 
   release(&np->lock);
 
@@ -337,6 +378,9 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // Write back and remove memory-mapped files.
+  munmapall(p);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -348,8 +392,11 @@ exit(int status)
 
   begin_op();
   iput(p->cwd);
+  if(p->exe)
+    iput(p->exe);
   end_op();
   p->cwd = 0;
+  p->exe = 0;
 
   // we might re-parent a child to init. we can't be precise about
   // waking up init, since we can't acquire its lock once we've
@@ -446,47 +493,117 @@ wait(uint64 addr)
   }
 }
 
+// Mark p RUNNABLE and append it to this CPU's run queue.
+// A woken process goes to the waker's CPU rather than the
+// one it last ran on, since the waker is likely to sleep
+// soon, while the old CPU may be idle in wfi and won't
+// look at its queue until the next interrupt.
+// Caller must hold p->lock.
+static void
+runqput(struct proc *p)
+{
+  struct cpu *c = mycpu();
+
+  if(!holding(&p->lock))
+    panic("runqput");
+  p->state = RUNNABLE;
+  p->rqnext = 0;
+  acquire(&c->rqlock);
+  if(c->rqtail)
+    c->rqtail->rqnext = p;
+  else
+    c->rqhead = p;
+  c->rqtail = p;
+  c->nrunq++;
+  release(&c->rqlock);
+}
+
+// Remove and return the process at the head of c's run
+// queue, or 0 if it is empty.
+static struct proc*
+runqget(struct cpu *c)
+{
+  struct proc *p;
+
+  acquire(&c->rqlock);
+  p = c->rqhead;
+  if(p){
+    c->rqhead = p->rqnext;
+    if(c->rqhead == 0)
+      c->rqtail = 0;
+    c->nrunq--;
+    p->rqnext = 0;
+  }
+  release(&c->rqlock);
+  return p;
+}
+
+// Take a process from the longest run queue of the other
+// CPUs. Only one run queue lock is held at a time.
+static struct proc*
+runqsteal(struct cpu *c)
+{
+  struct cpu *victim = 0;
+  struct proc *p;
+  int i, n = 0;
+
+  for(i = 0; i < NCPU; i++){
+    // an unlocked peek; runqget() re-checks under the lock.
+    if(&cpus[i] != c && cpus[i].nrunq > n){
+      victim = &cpus[i];
+      n = victim->nrunq;
+    }
+  }
+  if(victim == 0 || (p = runqget(victim)) == 0)
+    return 0;
+  c->nsteal++;
+  return p;
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - take a process from this CPU's run queue, or
+//    steal one from another CPU's.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
+// A process on a run queue is RUNNABLE and on no other
+// queue, so once dequeued no other CPU can pick it.
 void
 scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  uint64 t;
   
   c->proc = 0;
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
     
-    int found = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-
-        found = 1;
-      }
-      release(&p->lock);
-    }
-    if(found == 0) {
-      intr_on();
+    if((p = runqget(c)) == 0 && (p = runqsteal(c)) == 0){
+      // nothing to run; wait for an interrupt.
+      t = r_time();
       asm volatile("wfi");
+      c->idle += r_time() - t;
+      continue;
     }
+
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler");
+    p->state = RUNNING;
+    c->proc = p;
+    swtch(&c->context, &p->context);
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&p->lock);
   }
 }
 
@@ -523,7 +640,7 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  runqput(p);
   sched();
   release(&p->lock);
 }
@@ -555,20 +672,29 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct sleepq *sq;
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Must join chan's wait queue before releasing lk,
+  // since wakeup() only looks there. Once we are
+  // in the queue and hold p->lock, we can be
   // guaranteed that we won't miss any wakeup
   // (wakeup locks p->lock),
   // so it's okay to release lk.
-  if(lk != &p->lock){  //DOC: sleeplock0
+  if(lk != &p->lock)  //DOC: sleeplock0
     acquire(&p->lock);  //DOC: sleeplock1
-    release(lk);
-  }
 
   // Go to sleep.
   p->chan = chan;
+  sq = &sleepq[SQHASH(chan)];
+  acquire(&sq->lock);
+  p->sqnext = sq->head;
+  sq->head = p;
+  release(&sq->lock);
+
+  if(lk != &p->lock)
+    release(lk);
   p->state = SLEEPING;
 
   sched();
@@ -583,17 +709,54 @@ sleep(void *chan, struct spinlock *lk)
   }
 }
 
+// Take sleeping p out of its wait queue, if it is still
+// there, and make it RUNNABLE.
+// Caller must hold p->lock.
+static void
+wakeproc(struct proc *p)
+{
+  struct sleepq *sq = &sleepq[SQHASH(p->chan)];
+  struct proc **pp;
+
+  acquire(&sq->lock);
+  for(pp = &sq->head; *pp; pp = &(*pp)->sqnext){
+    if(*pp == p){
+      *pp = p->sqnext;
+      break;
+    }
+  }
+  release(&sq->lock);
+  runqput(p);
+}
+
 // Wake up all processes sleeping on chan.
 // Must be called without any p->lock.
 void
 wakeup(void *chan)
 {
-  struct proc *p;
+  struct sleepq *sq = &sleepq[SQHASH(chan)];
+  struct proc *woken[NPROC];
+  struct proc *p, **pp;
+  int i, n = 0;
+
+  // unlink the sleepers first, since p->lock must
+  // not be acquired while holding the queue lock.
+  acquire(&sq->lock);
+  for(pp = &sq->head; (p = *pp) != 0; ){
+    if(p->chan == chan){
+      *pp = p->sqnext;
+      woken[n++] = p;
+    } else {
+      pp = &p->sqnext;
+    }
+  }
+  release(&sq->lock);
 
-  for(p = proc; p < &proc[NPROC]; p++) {
+  for(i = 0; i < n; i++){
+    p = woken[i];
     acquire(&p->lock);
     if(p->state == SLEEPING && p->chan == chan) {
-      p->state = RUNNABLE;
+      wakeproc(p);
     }
     release(&p->lock);
   }
@@ -607,7 +770,7 @@ wakeup1(struct proc *p)
   if(!holding(&p->lock))
     panic("wakeup1");
   if(p->chan == p && p->state == SLEEPING) {
-    p->state = RUNNABLE;
+    wakeproc(p);
   }
 }
 
@@ -625,7 +788,7 @@ kill(int pid)
       p->killed = 1;
       if(p->state == SLEEPING){
         // Wake process from sleep().
-        p->state = RUNNABLE;
+        wakeproc(p);
       }
       release(&p->lock);
       return 0;
@@ -692,4 +855,11 @@ procdump(void)
     printf("%d %s %s", p->pid, state, p->name);
     printf("\n");
   }
+  for(int i = 0; i < NCPU; i++){
+    struct cpu *c = &cpus[i];
+    if(c->nsteal == 0 && c->idle == 0)
+      continue;
+    printf("cpu %d: runq %d steal %d idle %dM\n",
+           i, c->nrunq, c->nsteal, (int)(c->idle / 1000000));
+  }
 }
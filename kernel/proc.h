@@ -24,6 +24,13 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+
+  struct spinlock rqlock;      // protects the run queue
+  struct proc *rqhead;        // RUNNABLE processes waiting for this cpu
+  struct proc *rqtail;
+  int nrunq;                  // length of the run queue
+  int nsteal;                 // processes taken from other cpus' queues
+  uint64 idle;                // time spent waiting in wfi
 };
 
 extern struct cpu cpus[NCPU];
@@ -80,6 +87,27 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A region of a file mapped into a process by mmap().
+struct vma {
+  int used;
+  uint64 addr;                 // first virtual address, page-aligned
+  uint64 len;                  // length in bytes, page-aligned
+  int prot;                    // PROT_READ, PROT_WRITE, PROT_EXEC
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+  struct file *f;              // mapped file, with a reference held
+  uint off;                    // file offset of addr
+};
+
+// A loadable segment of the program, read in from the
+// program file by execfault() when first touched.
+struct seg {
+  uint64 va;                   // first virtual address, page-aligned
+  uint64 memsz;                // bytes in memory; 0 if slot unused
+  uint64 filesz;               // bytes from the file; the rest is zero
+  uint off;                    // file offset of va
+  int perm;                    // PTE_R, PTE_W, PTE_X
+};
+
 enum procstate { UNUSED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -94,6 +122,12 @@ struct proc {
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
 
+  // the run queue's cpu->rqlock must be held when using this:
+  struct proc *rqnext;         // Next process on the run queue
+
+  // the wait queue lock of p->chan must be held when using this:
+  struct proc *sqnext;         // Next process sleeping in the wait queue
+
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
@@ -102,5 +136,8 @@ struct proc {
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct vma vma[NVMA];        // Memory-mapped files
+  struct inode *exe;           // Program file, for execfault()
+  struct seg seg[NSEG];        // Program segments in exe
   char name[16];               // Process name (debugging)
 };
@@ -0,0 +1,207 @@
+//
+// Slab allocator for fixed-size kernel objects such as
+// struct file, struct inode and struct buf.
+//
+// A kcache hands out objects of one size, carved from slabs,
+// each a page from kalloc(). A slab's header sits at the
+// start of its page, so an object's slab is found by rounding
+// its address down. An object, once set up by the cache's
+// constructor, keeps that state while free, so for instance
+// its sleep-lock is initialized only once; the link that
+// threads free objects together lives after the object.
+//
+// Each CPU has a magazine of free objects per cache, touched
+// only with interrupts off, so most allocations and frees
+// take no lock at all. An empty magazine is refilled from
+// the slabs, and a full one returns half its objects, under
+// the cache's lock. A slab whose objects are all free goes
+// back to kalloc().
+//
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "slab.h"
+#include "defs.h"
+
+struct slab {
+  struct kcache *cache;
+  struct slab *next;     // on cache->partial
+  struct slab *prev;
+  char *free;            // free objects, linked through LINK()
+  int inuse;             // objects not on free
+};
+
+// the link word after object o of cache c.
+#define LINK(c, o) (*(char**)((o) + (c)->size))
+#define SLABHDR ((sizeof(struct slab) + 15) & ~15)
+
+static struct kcache *kcaches;
+
+// Set up cache c for objects of size bytes, calling ctor,
+// if it isn't 0, on each new object.
+// Only called while booting, on one CPU.
+void
+kcache_init(struct kcache *c, char *name, uint size, void (*ctor)(void*))
+{
+  memset(c, 0, sizeof(*c));
+  c->name = name;
+  c->size = (size + 7) & ~7;
+  c->stride = c->size + sizeof(char*);
+  c->perslab = (PGSIZE - SLABHDR) / c->stride;
+  if(c->perslab < 1)
+    panic("kcache_init: too big");
+  c->ctor = ctor;
+  initlock(&c->lock, name);
+  c->next = kcaches;
+  kcaches = c;
+}
+
+static void
+partialinsert(struct kcache *c, struct slab *s)
+{
+  s->prev = 0;
+  s->next = c->partial;
+  if(c->partial)
+    c->partial->prev = s;
+  c->partial = s;
+}
+
+static void
+partialremove(struct kcache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+}
+
+// Allocate and set up a new slab for c, and put it on the
+// partial list. Returns 0 if out of memory.
+// Caller must hold c->lock.
+static struct slab*
+newslab(struct kcache *c)
+{
+  struct slab *s;
+  char *o;
+  int i;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->cache = c;
+  s->free = 0;
+  s->inuse = 0;
+  for(i = c->perslab - 1; i >= 0; i--){
+    o = (char*)s + SLABHDR + i * c->stride;
+    if(c->ctor)
+      c->ctor(o);
+    LINK(c, o) = s->free;
+    s->free = o;
+  }
+  partialinsert(c, s);
+  c->nslab++;
+  return s;
+}
+
+// Move up to MAGSIZE/2 objects from c's slabs into m.
+// Caller must have interrupts off.
+static void
+refill(struct kcache *c, struct magazine *m)
+{
+  struct slab *s;
+  char *o;
+
+  acquire(&c->lock);
+  while(m->n < MAGSIZE/2){
+    if((s = c->partial) == 0 && (s = newslab(c)) == 0)
+      break;
+    o = s->free;
+    s->free = LINK(c, o);
+    s->inuse++;
+    if(s->free == 0)
+      partialremove(c, s);
+    m->obj[m->n++] = o;
+    c->nout++;
+  }
+  release(&c->lock);
+}
+
+// Return the oldest n objects in m to their slabs.
+// Caller must have interrupts off.
+static void
+flush(struct kcache *c, struct magazine *m, int n)
+{
+  struct slab *s;
+  char *o;
+  int i;
+
+  acquire(&c->lock);
+  for(i = 0; i < n; i++){
+    o = m->obj[i];
+    s = (struct slab*)PGROUNDDOWN((uint64)o);
+    if(s->cache != c)
+      panic("kcache_free: wrong cache");
+    if(s->free == 0)
+      partialinsert(c, s);
+    LINK(c, o) = s->free;
+    s->free = o;
+    s->inuse--;
+    c->nout--;
+    if(s->inuse == 0){
+      partialremove(c, s);
+      c->nslab--;
+      kfree(s);
+    }
+  }
+  release(&c->lock);
+  memmove(m->obj, m->obj + n, (m->n - n) * sizeof(m->obj[0]));
+  m->n -= n;
+}
+
+// Allocate an object from c.
+// Returns 0 if out of memory.
+void*
+kcache_alloc(struct kcache *c)
+{
+  struct magazine *m;
+  void *o;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == 0)
+    refill(c, m);
+  o = m->n > 0 ? m->obj[--m->n] : 0;
+  pop_off();
+  return o;
+}
+
+// Free object o, from kcache_alloc(c). It should be left in
+// the state its constructor set up.
+void
+kcache_free(struct kcache *c, void *o)
+{
+  struct magazine *m;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == MAGSIZE)
+    flush(c, m, MAGSIZE/2);
+  m->obj[m->n++] = o;
+  pop_off();
+}
+
+// Print each cache's usage to the console.
+// Runs when user types ^P on console.
+// No lock to avoid wedging a stuck machine further.
+void
+kcachedump(void)
+{
+  struct kcache *c;
+
+  for(c = kcaches; c; c = c->next)
+    printf("kcache %s: %d slabs, %d objects in use or cached\n",
+           c->name, c->nslab, c->nout);
+}
@@ -0,0 +1,26 @@
+// A cache of fixed-size kernel objects; see slab.c.
+
+#define MAGSIZE 16  // objects in a per-CPU magazine
+
+struct slab;
+
+struct magazine {
+  int n;                 // objects in obj[]
+  void *obj[MAGSIZE];
+};
+
+struct kcache {
+  char *name;
+  uint size;             // bytes per object
+  uint stride;           // bytes per object in a slab, with its link
+  int perslab;           // objects per slab
+  void (*ctor)(void*);   // sets up a new object, or 0
+
+  struct spinlock lock;  // protects everything below
+  struct slab *partial;  // slabs with some objects free
+  int nslab;             // slabs allocated
+  int nout;              // objects out of slabs, incl. magazines
+  struct kcache *next;   // all caches, for kcachedump()
+
+  struct magazine mag[NCPU];  // only touched by its own CPU
+};
@@ -1,13 +1,43 @@
 #include "types.h"
 
+// memset, memcmp and memmove work a 64-bit word at a time
+// (four at a time in the main loops) once the pointers are
+// aligned, falling back to bytes for the ends. memmove also
+// handles a source and destination that are misaligned with
+// respect to each other, by shifting aligned source words
+// into place; the partial words it reads at either end lie
+// in the same aligned word as a byte of the source, and so
+// in the same page.
+
+#define WSIZE sizeof(uint64)
+#define ALIGNED(p) (((uint64)(p) & (WSIZE-1)) == 0)
+
 void*
 memset(void *dst, int c, uint n)
 {
   char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uint64 w, *wdst;
+
+  while(n > 0 && !ALIGNED(cdst)){
+    *cdst++ = c;
+    n--;
+  }
+  w = (uchar)c;
+  w |= w << 8;
+  w |= w << 16;
+  w |= w << 32;
+  wdst = (uint64 *) cdst;
+  for(; n >= 4*WSIZE; n -= 4*WSIZE, wdst += 4){
+    wdst[0] = w;
+    wdst[1] = w;
+    wdst[2] = w;
+    wdst[3] = w;
   }
+  for(; n >= WSIZE; n -= WSIZE)
+    *wdst++ = w;
+  cdst = (char *) wdst;
+  while(n-- > 0)
+    *cdst++ = c;
   return dst;
 }
 
@@ -18,6 +48,16 @@ memcmp(const void *v1, const void *v2, uint n)
 
   s1 = v1;
   s2 = v2;
+  if(((uint64)s1 ^ (uint64)s2) % WSIZE == 0){
+    while(n > 0 && !ALIGNED(s1)){
+      if(*s1 != *s2)
+        return *s1 - *s2;
+      s1++, s2++, n--;
+    }
+    // skip equal words; the bytes below find the difference.
+    while(n >= WSIZE && *(uint64*)s1 == *(uint64*)s2)
+      s1 += WSIZE, s2 += WSIZE, n -= WSIZE;
+  }
   while(n-- > 0){
     if(*s1 != *s2)
       return *s1 - *s2;
@@ -27,22 +67,96 @@ memcmp(const void *v1, const void *v2, uint n)
   return 0;
 }
 
+// Copy n bytes forwards from s to d, where d is aligned
+// and s is not.
+static void
+shiftcopy(char *d, const char *s, uint n)
+{
+  int sh = ((uint64)s & (WSIZE-1)) * 8;
+  const uint64 *ws = (const uint64 *) (s - sh/8);
+  uint64 *wd = (uint64 *) d;
+  uint64 lo, hi;
+
+  if(n >= WSIZE){
+    lo = *ws++;
+    for(; n >= WSIZE; n -= WSIZE){
+      hi = *ws++;
+      *wd++ = (lo >> sh) | (hi << (64 - sh));
+      lo = hi;
+    }
+    d = (char *) wd;
+    s = (const char *) ws - WSIZE + sh/8;
+  }
+  while(n-- > 0)
+    *d++ = *s++;
+}
+
 void*
 memmove(void *dst, const void *src, uint n)
 {
   const char *s;
   char *d;
+  uint64 w0, w1, w2, w3;
 
   s = src;
   d = dst;
   if(s < d && s + n > d){
     s += n;
     d += n;
+    if(((uint64)s ^ (uint64)d) % WSIZE == 0){
+      while(n > 0 && !ALIGNED(d)){
+        *--d = *--s;
+        n--;
+      }
+      for(; n >= 4*WSIZE; n -= 4*WSIZE){
+        s -= 4*WSIZE;
+        d -= 4*WSIZE;
+        w0 = ((uint64*)s)[0];
+        w1 = ((uint64*)s)[1];
+        w2 = ((uint64*)s)[2];
+        w3 = ((uint64*)s)[3];
+        ((uint64*)d)[3] = w3;
+        ((uint64*)d)[2] = w2;
+        ((uint64*)d)[1] = w1;
+        ((uint64*)d)[0] = w0;
+      }
+      for(; n >= WSIZE; n -= WSIZE){
+        s -= WSIZE;
+        d -= WSIZE;
+        *(uint64*)d = *(uint64*)s;
+      }
+    }
     while(n-- > 0)
       *--d = *--s;
-  } else
+  } else {
+    while(n > 0 && !ALIGNED(d)){
+      *d++ = *s++;
+      n--;
+    }
+    if(!ALIGNED(s)){
+      shiftcopy(d, s, n);
+      return dst;
+    }
+    for(; n >= 4*WSIZE; n -= 4*WSIZE){
+      w0 = ((uint64*)s)[0];
+      w1 = ((uint64*)s)[1];
+      w2 = ((uint64*)s)[2];
+      w3 = ((uint64*)s)[3];
+      ((uint64*)d)[0] = w0;
+      ((uint64*)d)[1] = w1;
+      ((uint64*)d)[2] = w2;
+      ((uint64*)d)[3] = w3;
+      s += 4*WSIZE;
+      d += 4*WSIZE;
+    }
+    for(; n >= WSIZE; n -= WSIZE){
+      *(uint64*)d = *(uint64*)s;
+      s += WSIZE;
+      d += WSIZE;
+    }
     while(n-- > 0)
       *d++ = *s++;
+  }
 
   return dst;
 }
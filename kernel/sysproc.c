@@ -6,6 +6,7 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "memstat.h"
 
 uint64
 sys_exit(void)
@@ -35,6 +36,10 @@ sys_wait(void)
   uint64 p;
   if(argaddr(0, &p) < 0)
     return -1;
+  // wait() copies out the status holding spinlocks.
+  if(p != 0 && (mmapprefault(myproc(), p, sizeof(int), 1) < 0 ||
+                 execprefault(myproc(), p, sizeof(int), 1) < 0))
+    return -1;
   return wait(p);
 }
 
@@ -56,21 +61,25 @@ uint64
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
 
   if(argint(0, &n) < 0)
     return -1;
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(myproc()->killed){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
-  return 0;
+  if(n < 0)
+    n = 0;
+  return timer_sleep(r_time() + (uint64)n * CLINT_INTERVAL);
+}
+
+// sleep for n milliseconds.
+uint64
+sys_msleep(void)
+{
+  int n;
+
+  if(argint(0, &n) < 0)
+    return -1;
+  if(n < 0)
+    n = 0;
+  return timer_sleep(r_time() + (uint64)n * (CLINT_FREQ/1000));
 }
 
 uint64
@@ -95,3 +104,18 @@ sys_uptime(void)
   release(&tickslock);
   return xticks;
 }
+
+// report physical memory allocator statistics.
+uint64
+sys_memstat(void)
+{
+  uint64 addr;
+  struct memstat st;
+
+  if(argaddr(0, &addr) < 0)
+    return -1;
+  kmemstat(&st);
+  if(copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
@@ -0,0 +1,165 @@
+//
+// Kernel timers, for processes sleeping until a point in time.
+//
+// Sleepers are kept in a min-heap ordered by deadline. The
+// earliest deadline is handed to timervec in kernelvec.S
+// through this hart's mscratch area; an ecall has machine mode
+// lower the hart's CLINT MTIMECMP register to it, so the hart
+// is interrupted when it expires rather than at the next clock
+// tick, and only the expired sleepers are woken.
+//
+
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+struct timer {
+  uint64 when;  // mtime at which to wake up
+  int fired;    // has when passed?
+  int idx;      // position in timers.heap[]
+};
+
+struct {
+  struct spinlock lock;
+  struct timer *heap[NPROC];
+  int n;
+  uint64 next;  // earliest deadline, or ~0; may be read without the lock
+} timers;
+
+extern uint64 mscratch0[]; // start.c
+
+void
+timer_init(void)
+{
+  initlock(&timers.lock, "timers");
+  timers.next = ~0ULL;
+}
+
+static void
+swap(int i, int j)
+{
+  struct timer *t = timers.heap[i];
+
+  timers.heap[i] = timers.heap[j];
+  timers.heap[j] = t;
+  timers.heap[i]->idx = i;
+  timers.heap[j]->idx = j;
+}
+
+static void
+siftup(int i)
+{
+  while(i > 0 && timers.heap[(i-1)/2]->when > timers.heap[i]->when){
+    swap(i, (i-1)/2);
+    i = (i-1)/2;
+  }
+}
+
+static void
+siftdown(int i)
+{
+  int c;
+
+  while((c = 2*i + 1) < timers.n){
+    if(c+1 < timers.n && timers.heap[c+1]->when < timers.heap[c]->when)
+      c++;
+    if(timers.heap[i]->when <= timers.heap[c]->when)
+      break;
+    swap(i, c);
+    i = c;
+  }
+}
+
+static void
+heapremove(int i)
+{
+  timers.n--;
+  if(i != timers.n){
+    timers.heap[i] = timers.heap[timers.n];
+    timers.heap[i]->idx = i;
+    siftup(i);
+    siftdown(timers.heap[i]->idx);
+  }
+  timers.next = timers.n > 0 ? timers.heap[0]->when : ~0ULL;
+}
+
+// Ask for a timer interrupt on this hart no later than when.
+// MTIMECMP belongs to machine mode, so record the deadline
+// and ecall to have timervec lower MTIMECMP to it. A timer
+// interrupt may come in between, but timervec then programs
+// the deadline itself.
+static void
+program(uint64 when)
+{
+  volatile uint64 *scratch;
+
+  push_off();
+  scratch = &mscratch0[32 * cpuid()];
+  if(when < scratch[8]){
+    scratch[8] = when;
+    asm volatile("ecall");
+  }
+  pop_off();
+}
+
+// Sleep until mtime reaches when.
+// Returns 0, or -1 if the process was killed.
+int
+timer_sleep(uint64 when)
+{
+  struct proc *p = myproc();
+  struct timer t;
+
+  if(when <= r_time())
+    return 0;
+
+  acquire(&timers.lock);
+  if(timers.n >= NPROC)
+    panic("timer_sleep");
+  t.when = when;
+  t.fired = 0;
+  t.idx = timers.n;
+  timers.heap[timers.n++] = &t;
+  siftup(t.idx);
+  if(timers.heap[0] == &t){
+    timers.next = when;
+    program(when);
+  }
+
+  while(!t.fired){
+    if(p->killed){
+      heapremove(t.idx);
+      release(&timers.lock);
+      return -1;
+    }
+    sleep(&t, &timers.lock);
+  }
+  release(&timers.lock);
+  return 0;
+}
+
+// Wake the sleepers whose deadlines have passed.
+// Called on every hart's timer interrupt.
+void
+timer_intr(void)
+{
+  struct timer *t;
+  uint64 now = r_time();
+
+  if(now < timers.next)
+    return;
+
+  acquire(&timers.lock);
+  while(timers.n > 0 && timers.heap[0]->when <= now){
+    t = timers.heap[0];
+    heapremove(0);
+    t->fired = 1;
+    wakeup(t);
+  }
+  if(timers.n > 0)
+    program(timers.next);
+  release(&timers.lock);
+}
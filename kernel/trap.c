@@ -27,6 +27,9 @@ void
 trapinithart(void)
 {
   w_stvec((uint64)kernelvec);
+
+  // let user programs read the time CSR, for benchmarks.
+  w_scounteren(r_scounteren() | 2);
 }
 
 //
@@ -65,6 +68,10 @@ usertrap(void)
     intr_on();
 
     syscall();
+  } else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+            vmfault(p->pagetable, r_stval(), r_scause() == 15) != 0){
+    // page fault on a lazily-allocated or copy-on-write page,
+    // which is now mapped.
   } else if((which_dev = devintr()) != 0){
     // ok
   } else {
@@ -162,9 +169,10 @@ kerneltrap()
 void
 clockintr()
 {
+  // timer_intr() deadlines interrupt too, so count
+  // ticks from mtime rather than from interrupts.
   acquire(&tickslock);
-  ticks++;
-  wakeup(&ticks);
+  ticks = r_time() / CLINT_INTERVAL;
   release(&tickslock);
 }
 
@@ -204,13 +212,15 @@ devintr()
     // software interrupt from a machine-mode timer interrupt,
     // forwarded by timervec in kernelvec.S.
 
+    // acknowledge the software interrupt by clearing
+    // the SSIP bit in sip. do it first, so that a deadline
+    // that expires while we're in here isn't lost.
+    w_sip(r_sip() & ~2);
+
     if(cpuid() == 0){
       clockintr();
     }
-    
-    // acknowledge the software interrupt by clearing
-    // the SSIP bit in sip.
-    w_sip(r_sip() & ~2);
+    timer_intr();
 
     return 2;
   } else {
@@ -43,9 +43,11 @@
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX     29
 
-// this many virtio descriptors.
-// must be a power of two.
-#define NUM 8
+// at most this many virtio descriptors; the queue size
+// is the smaller of this and the device's QUEUE_NUM_MAX.
+// must be a power of two, and small enough that the
+// descriptors and avail ring fit in one page.
+#define NUM 128
 
 struct VRingDesc {
   uint64 addr;
@@ -55,6 +57,7 @@ struct VRingDesc {
 };
 #define VRING_DESC_F_NEXT  1 // chained with another descriptor
 #define VRING_DESC_F_WRITE 2 // device writes (vs read)
+#define VRING_DESC_F_INDIRECT 4 // addr points to a table of descriptors
 
 struct VRingUsedElem {
   uint32 id;   // index of start of completed descriptor chain
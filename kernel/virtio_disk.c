@@ -20,6 +20,14 @@
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
+// the request header for a disk operation.
+// qemu's virtio-blk.c reads it.
+struct virtio_blk_outhdr {
+  uint32 type;
+  uint32 reserved;
+  uint64 sector;
+};
+
 static struct disk {
  // memory for virtio descriptors &c for queue 0.
  // this is a global instead of allocated because it must
@@ -31,13 +39,19 @@ static struct disk {
   struct UsedArea *used;
 
   // our own book-keeping.
+  int num;         // queue size negotiated with the device
+  int indirect;    // device supports indirect descriptors?
   char free[NUM];  // is a descriptor free?
-  uint16 used_idx; // we've looked this far in used[2..NUM].
+  uint16 used_idx; // we've looked this far in used->elems[].
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
+  // with indirect descriptors, the ring descriptor
+  // points to this request's ind[] table.
   struct {
+    struct VRingDesc ind[3];
+    struct virtio_blk_outhdr hdr;
     struct buf *b;
     char status;
   } info[NUM];
@@ -74,7 +88,8 @@ virtio_disk_init(void)
   features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
   features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
+  // keep VIRTIO_RING_F_INDIRECT_DESC if the device offers it.
+  disk.indirect = (features >> VIRTIO_RING_F_INDIRECT_DESC) & 1;
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
 
   // tell device that feature negotiation is complete.
@@ -92,21 +107,24 @@ virtio_disk_init(void)
   uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
   if(max == 0)
     panic("virtio disk has no queue 0");
-  if(max < NUM)
+  if(max < 4)
     panic("virtio disk max queue too short");
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+  disk.num = NUM;
+  while(disk.num > max)
+    disk.num /= 2;
+  *R(VIRTIO_MMIO_QUEUE_NUM) = disk.num;
   memset(disk.pages, 0, sizeof(disk.pages));
   *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)disk.pages) >> PGSHIFT;
 
   // desc = pages -- num * VRingDesc
-  // avail = pages + 0x40 -- 2 * uint16, then num * uint16
+  // avail = pages + num * 16 -- 2 * uint16, then num * uint16
   // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem
 
   disk.desc = (struct VRingDesc *) disk.pages;
-  disk.avail = (uint16*)(((char*)disk.desc) + NUM*sizeof(struct VRingDesc));
+  disk.avail = (uint16*)(((char*)disk.desc) + disk.num*sizeof(struct VRingDesc));
   disk.used = (struct UsedArea *) (disk.pages + PGSIZE);
 
-  for(int i = 0; i < NUM; i++)
+  for(int i = 0; i < disk.num; i++)
     disk.free[i] = 1;
 
   // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
@@ -116,7 +134,7 @@ virtio_disk_init(void)
 static int
 alloc_desc()
 {
-  for(int i = 0; i < NUM; i++){
+  for(int i = 0; i < disk.num; i++){
     if(disk.free[i]){
       disk.free[i] = 0;
       return i;
@@ -129,7 +147,7 @@ alloc_desc()
 static void
 free_desc(int i)
 {
-  if(i >= NUM)
+  if(i >= disk.num)
     panic("virtio_disk_intr 1");
   if(disk.free[i])
     panic("virtio_disk_intr 2");
@@ -165,63 +183,70 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// fill in the three descriptors of a request, d[0..2]:
+// one for type/reserved/sector, one for the data, one
+// for a 1-byte status result. next[] are their indices
+// in whichever table they live in.
+static void
+fill_desc(struct VRingDesc *d, int *next, int id, struct buf *b, int write)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  disk.info[id].hdr.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+  disk.info[id].hdr.reserved = 0;
+  disk.info[id].hdr.sector = b->blockno * (BSIZE / 512);
 
-  acquire(&disk.vdisk_lock);
+  d[0].addr = (uint64) &disk.info[id].hdr;
+  d[0].len = sizeof(disk.info[id].hdr);
+  d[0].flags = VRING_DESC_F_NEXT;
+  d[0].next = next[1];
 
-  // the spec says that legacy block operations use three
-  // descriptors: one for type/reserved/sector, one for
-  // the data, one for a 1-byte status result.
+  d[1].addr = (uint64) b->data;
+  d[1].len = BSIZE;
+  if(write)
+    d[1].flags = 0; // device reads b->data
+  else
+    d[1].flags = VRING_DESC_F_WRITE; // device writes b->data
+  d[1].flags |= VRING_DESC_F_NEXT;
+  d[1].next = next[2];
+
+  disk.info[id].status = 0xff; // device writes 0 on success
+  d[2].addr = (uint64) &disk.info[id].status;
+  d[2].len = 1;
+  d[2].flags = VRING_DESC_F_WRITE; // device writes the status
+  d[2].next = 0;
+}
 
-  // allocate the three descriptors.
+// put a request for b on the avail ring, without telling
+// the device. if there are no free descriptors, tell the
+// device about the requests queued so far and wait for
+// some to complete. caller must hold vdisk_lock.
+static void
+submit(struct buf *b, int write)
+{
   int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
+
+  if(disk.indirect){
+    // one ring descriptor, pointing at the request's
+    // own three-entry table.
+    while((idx[0] = alloc_desc()) < 0){
+      *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0;
+      sleep(&disk.free[0], &disk.vdisk_lock);
     }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+    int next[3] = { 0, 1, 2 };
+    fill_desc(disk.info[idx[0]].ind, next, idx[0], b, write);
+    disk.desc[idx[0]].addr = (uint64) disk.info[idx[0]].ind;
+    disk.desc[idx[0]].len = sizeof(disk.info[idx[0]].ind);
+    disk.desc[idx[0]].flags = VRING_DESC_F_INDIRECT;
+    disk.desc[idx[0]].next = 0;
+  } else {
+    while(alloc3_desc(idx) != 0){
+      *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0;
+      sleep(&disk.free[0], &disk.vdisk_lock);
+    }
+    struct VRingDesc d[3];
+    fill_desc(d, idx, idx[0], b, write);
+    for(int i = 0; i < 3; i++)
+      disk.desc[idx[i]] = d[i];
   }
-  
-  // format the three descriptors.
-  // qemu's virtio-blk.c reads them.
-
-  struct virtio_blk_outhdr {
-    uint32 type;
-    uint32 reserved;
-    uint64 sector;
-  } buf0;
-
-  if(write)
-    buf0.type = VIRTIO_BLK_T_OUT; // write the disk
-  else
-    buf0.type = VIRTIO_BLK_T_IN; // read the disk
-  buf0.reserved = 0;
-  buf0.sector = sector;
-
-  // buf0 is on a kernel stack, which is not direct mapped,
-  // thus the call to kvmpa().
-  disk.desc[idx[0]].addr = (uint64) kvmpa((uint64) &buf0);
-  disk.desc[idx[0]].len = sizeof(buf0);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
-
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
-
-  disk.info[idx[0]].status = 0;
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
 
   // record struct buf for virtio_disk_intr().
   b->disk = 1;
@@ -231,40 +256,72 @@ virtio_disk_rw(struct buf *b, int write)
   // avail[1] tells the device how far to look in avail[2...].
   // avail[2...] are desc[] indices the device should process.
   // we only tell device the first index in our chain of descriptors.
-  disk.avail[2 + (disk.avail[1] % NUM)] = idx[0];
+  disk.avail[2 + (disk.avail[1] % disk.num)] = idx[0];
   __sync_synchronize();
   disk.avail[1] = disk.avail[1] + 1;
+}
+
+// read or write the n buffers in bufs[], all locked, and
+// wait until all of them are done. the requests are all
+// queued before the device is told about them, so they
+// can be in flight at the same time.
+void
+virtio_disk_rwv(struct buf **bufs, int n, int write)
+{
+  acquire(&disk.vdisk_lock);
 
+  for(int i = 0; i < n; i++)
+    submit(bufs[i], write);
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+  // Wait for virtio_disk_intr() to say the requests have finished.
+  for(int i = 0; i < n; i++){
+    while(bufs[i]->disk == 1) {
+      sleep(bufs[i], &disk.vdisk_lock);
+    }
   }
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
-
   release(&disk.vdisk_lock);
 }
 
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_rwv(&b, 1, write);
+}
+
 void
 virtio_disk_intr()
 {
   acquire(&disk.vdisk_lock);
 
-  while((disk.used_idx % NUM) != (disk.used->id % NUM)){
-    int id = disk.used->elems[disk.used_idx].id;
+  // the device won't raise another interrupt until we tell it
+  // we've seen this interrupt, which the following line does.
+  // this may race with the device writing new entries to
+  // the "used" ring, in which case we may process the new
+  // completion entries in this interrupt, and have nothing to do
+  // in the next interrupt, which is harmless.
+  *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+
+  // the device increments used->id after filling in
+  // used->elems[]; don't read elems[] before seeing id.
+  __sync_synchronize();
+
+  while(disk.used_idx != disk.used->id){
+    __sync_synchronize();
+    int id = disk.used->elems[disk.used_idx % disk.num].id;
 
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
     
-    disk.info[id].b->disk = 0;   // disk is done with buf
-    wakeup(disk.info[id].b);
+    struct buf *b = disk.info[id].b;
+    disk.info[id].b = 0;
+    free_chain(id);
+    b->disk = 0;   // disk is done with buf
+    wakeup(b);
 
-    disk.used_idx = (disk.used_idx + 1) % NUM;
+    disk.used_idx += 1;
   }
-  *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
 
   release(&disk.vdisk_lock);
 }
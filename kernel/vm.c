@@ -3,6 +3,8 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 
@@ -17,6 +19,9 @@ extern char trampoline[]; // trampoline.S
 
 /*
  * create a direct-map page table for the kernel.
+ * mappages() uses 2 MB megapages for the aligned parts of
+ * RAM and the PLIC, so most of the direct map takes no
+ * level-0 page-table pages and one TLB entry per 2 MB.
  */
 void
 kvminit()
@@ -58,7 +63,8 @@ kvminithart()
 
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
-// create any required page-table pages.
+// create any required page-table pages. If va lies in a
+// megapage, return the megapage's level-1 PTE.
 //
 // The risc-v Sv39 scheme has three levels of page-table
 // pages. A page-table page contains 512 64-bit PTEs.
@@ -68,15 +74,33 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+// A leaf PTE at level 1 maps a 2 MB megapage, whose
+// offset is the low 21 bits.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  int level = 0;
+
+  return walklevel(pagetable, va, alloc, &level);
+}
+
+// Like walk(), but descend only as far as the page-table
+// page at *level, returning the PTE for va there. Stops
+// early at a leaf PTE found on the way. Sets *level to the
+// level of the PTE returned.
+pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int *level)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  for(int l = 2; l > *level; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
     if(*pte & PTE_V) {
+      if(PTE_LEAF(*pte)){
+        *level = l;
+        return pte;
+      }
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
       if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
@@ -85,7 +109,7 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(*level, va)];
 }
 
 // Look up a virtual address, return the physical address,
@@ -96,18 +120,19 @@ walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
   uint64 pa;
+  int level = 0;
 
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
+  pte = walklevel(pagetable, va, 0, &level);
   if(pte == 0)
     return 0;
   if((*pte & PTE_V) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
+  pa = PTE2PA(*pte) + PGROUNDDOWN(va % PXSIZE(level));
   return pa;
 }
 
@@ -128,64 +153,88 @@ kvmmap(uint64 va, uint64 pa, uint64 sz, int perm)
 uint64
 kvmpa(uint64 va)
 {
-  uint64 off = va % PGSIZE;
   pte_t *pte;
   uint64 pa;
+  int level = 0;
   
-  pte = walk(kernel_pagetable, va, 0);
+  pte = walklevel(kernel_pagetable, va, 0, &level);
   if(pte == 0)
     panic("kvmpa");
   if((*pte & PTE_V) == 0)
     panic("kvmpa");
   pa = PTE2PA(*pte);
-  return pa+off;
+  return pa + va % PXSIZE(level);
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
-// be page-aligned. Returns 0 on success, -1 if walk() couldn't
-// allocate a needed page-table page.
+// be page-aligned. Wherever va and pa are both 2 MB aligned
+// and at least 2 MB remain, a single megapage PTE is used,
+// unless a page-table page already covers part of that range.
+// Returns 0 on success, -1 if walk() couldn't allocate a
+// needed page-table page.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
   uint64 a, last;
   pte_t *pte;
+  int level;
 
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
   for(;;){
-    if((pte = walk(pagetable, a, 1)) == 0)
+    level = a % MEGAPGSIZE == 0 && pa % MEGAPGSIZE == 0 &&
+            last - a >= MEGAPGSIZE - PGSIZE;
+    if((pte = walklevel(pagetable, a, 1, &level)) == 0)
       return -1;
+    if(level == 1 && (*pte & PTE_V) && !PTE_LEAF(*pte)){
+      level = 0;
+      if((pte = walklevel(pagetable, a, 1, &level)) == 0)
+        return -1;
+    }
     if(*pte & PTE_V)
       panic("remap");
     *pte = PA2PTE(pa) | perm | PTE_V;
-    if(a == last)
+    if(last - a < PXSIZE(level))
       break;
-    a += PGSIZE;
-    pa += PGSIZE;
+    a += PXSIZE(level);
+    pa += PXSIZE(level);
   }
   return 0;
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
-// Optionally free the physical memory.
+// page-aligned. Pages that were never faulted in by a lazy
+// sbrk() are skipped. Optionally free the physical memory.
+// A megapage must be removed whole; split it first with
+// uvmsplit() to remove only part of it.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
   uint64 a;
   pte_t *pte;
+  int level;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+    level = 0;
+    if((pte = walklevel(pagetable, a, 0, &level)) == 0)
+      continue;
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
+    if(level == 1){
+      if(a % MEGAPGSIZE != 0 || a + MEGAPGSIZE > va + npages*PGSIZE)
+        panic("uvmunmap: part of a megapage");
+      if(do_free)
+        kfree_pages((void*)PTE2PA(*pte), MEGAORDER);
+      *pte = 0;
+      a += MEGAPGSIZE - PGSIZE;
+      continue;
+    }
     if(do_free){
       uint64 pa = PTE2PA(*pte);
       kfree((void*)pa);
@@ -254,7 +303,8 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
+// process size.  Returns the new process size, or oldsz if a
+// megapage straddling newsz could not be split.
 uint64
 uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 {
@@ -262,6 +312,9 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
     return oldsz;
 
   if(PGROUNDUP(newsz) < PGROUNDUP(oldsz)){
+    if(PGROUNDUP(newsz) % MEGAPGSIZE != 0 &&
+       uvmsplit(pagetable, PGROUNDUP(newsz)) < 0)
+      return oldsz;
     int npages = (PGROUNDUP(oldsz) - PGROUNDUP(newsz)) / PGSIZE;
     uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1);
   }
@@ -299,42 +352,226 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Given a parent process's page table, share
+// its memory with a child's page table.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+{
+  return uvmshare(old, new, 0, sz, 1);
+}
+
+// Map the pages of old from va up to va+sz into new at
+// the same addresses. If cow is set, writable pages are
+// mapped read-only with PTE_COW in both page tables and
+// copied by uvmcow() on the first write; otherwise, and
+// for read-only pages, both page tables simply share the
+// page. Pages that are not present are skipped. Megapages
+// that lie wholly in the range stay megapages in both;
+// ones that don't are split.
+// returns 0 on success, -1 on failure.
+// unmaps any pages mapped into new on failure.
+int
+uvmshare(pagetable_t old, pagetable_t new, uint64 va, uint64 sz, int cow)
 {
   pte_t *pte;
-  uint64 pa, i;
+  uint64 pa, i, j;
   uint flags;
-  char *mem;
+  int level;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
+  for(i = va; i < va + sz; i += PXSIZE(level)){
+    level = 0;
+    if((pte = walklevel(old, i, 0, &level)) == 0)
+      continue;  // lazily-allocated page not yet touched
     if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      continue;
+    if(level == 1 && (i % MEGAPGSIZE != 0 || i + MEGAPGSIZE > va + sz)){
+      if(uvmsplit(old, i) < 0)
+        goto err;
+      level = 0;
+      pte = walk(old, i, 0);
+    }
+    if(cow && (*pte & PTE_W))
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if(mappages(new, i, PXSIZE(level), pa, flags) != 0)
       goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      goto err;
-    }
+    for(j = 0; j < PXSIZE(level); j += PGSIZE)
+      krefinc((void*)(pa + j));
   }
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, va, (i - va) / PGSIZE, 1);
   return -1;
 }
 
+// If va lies in a megapage of pagetable, map the megapage's
+// memory with 512 4 KB PTEs instead, with the same flags.
+// Returns 0, or -1 if out of memory.
+int
+uvmsplit(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  pagetable_t pt;
+  uint64 pa;
+  int level = 0;
+
+  pte = walklevel(pagetable, va, 0, &level);
+  if(pte == 0 || level != 1 || (*pte & PTE_V) == 0)
+    return 0;
+  if((pt = (pagetable_t)kalloc()) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  for(int i = 0; i < 512; i++)
+    pt[i] = PA2PTE(pa + i*PGSIZE) | PTE_FLAGS(*pte);
+  *pte = PA2PTE(pt) | PTE_V;
+  return 0;
+}
+
+// Resolve a write to the copy-on-write page at va by giving
+// the page table a private, writable copy of the page. If no
+// one else shares the page any more, just make it writable.
+// A shared megapage is copied whole if a free 2 MB block is
+// available, and otherwise split so only one page is copied.
+// Returns 0 on success, -1 if va is not a COW page or
+// memory is exhausted.
+static int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa, i;
+  uint flags;
+  char *mem;
+  int level = 0;
+
+  if(va >= MAXVA)
+    return -1;
+  pte = walklevel(pagetable, va, 0, &level);
+  if(pte == 0)
+    return -1;
+  if((*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+
+  if(level == 1){
+    for(i = 0; i < MEGAPGSIZE; i += PGSIZE){
+      if(krefcnt((void*)(pa + i)) != 1)
+        break;
+    }
+    if(i == MEGAPGSIZE){
+      *pte = PA2PTE(pa) | flags;
+      return 0;
+    }
+    if((mem = kalloc_pages(MEGAORDER)) != 0){
+      memmove(mem, (char*)pa, MEGAPGSIZE);
+      *pte = PA2PTE(mem) | flags;
+      kfree_pages((void*)pa, MEGAORDER);
+      return 0;
+    }
+    if(uvmsplit(pagetable, va) < 0)
+      return -1;
+    pte = walk(pagetable, va, 0);
+    pa = PTE2PA(*pte);
+  }
+
+  if(krefcnt((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    return 0;
+  }
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  kfree((void*)pa);
+  return 0;
+}
+
+// Make the user page containing va accessible for a read
+// (or, if write is set, a write) by the current process,
+// whose page table is pagetable: copy a copy-on-write page,
+// allocate a zeroed page for heap memory that sbrk()
+// handed out lazily, or read in a page of the program or of
+// an mmap()ed file.
+// A 2 MB-aligned stretch of heap that is untouched so far
+// gets a megapage, if a free 2 MB block is available.
+// Used for user page faults and by copyin/copyout.
+// Returns the physical address of the page, or 0 if the
+// access is not allowed or memory is exhausted.
+uint64
+vmfault(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+  char *mem;
+  uint64 a;
+  int level = 0;
+
+  if(va >= MAXVA)
+    return 0;
+  va = PGROUNDDOWN(va);
+
+  pte = walklevel(pagetable, va, 0, &level);
+  if(pte && (*pte & PTE_V)){
+    if((*pte & PTE_U) == 0)
+      return 0;
+    if(write && (*pte & PTE_COW)){
+      if(uvmcow(pagetable, va) < 0)
+        return 0;
+      level = 0;
+      pte = walklevel(pagetable, va, 0, &level);
+    }
+    if(write && (*pte & PTE_W) == 0)
+      return 0;
+    // copyout() writes through here, and a hart may fault on a
+    // store instead of setting D; munmap() relies on D to know
+    // which shared pages to write back.
+    if(write)
+      *pte |= PTE_D;
+    return PTE2PA(*pte) + va % PXSIZE(level);
+  }
+
+  if(p == 0 || p->pagetable != pagetable)
+    return 0;
+
+  // not mapped; is it part of a memory-mapped file?
+  if(va >= p->sz)
+    return mmapfault(p, va, write);
+
+  // part of the program, not yet read in?
+  if(execseg(p, va, PGSIZE))
+    return execfault(p, va, write);
+
+  // nothing at all mapped in the surrounding 2 MB, which is
+  // all heap?
+  a = va - va % MEGAPGSIZE;
+  level = 1;
+  pte = walklevel(pagetable, a, 0, &level);
+  if(a + MEGAPGSIZE <= p->sz && (pte == 0 || (*pte & PTE_V) == 0) &&
+     !execseg(p, a, MEGAPGSIZE) && (mem = kalloc_pages(MEGAORDER)) != 0){
+    memset(mem, 0, MEGAPGSIZE);
+    if(mappages(pagetable, a, MEGAPGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
+      kfree_pages(mem, MEGAORDER);
+      return 0;
+    }
+    return (uint64)mem + (va - a);
+  }
+
+  // part of the lazily-allocated heap.
+  if((mem = kalloc()) == 0)
+    return 0;
+  memset(mem, 0, PGSIZE);
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
+    kfree(mem);
+    return 0;
+  }
+  return (uint64)mem;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -358,7 +595,7 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = vmfault(pagetable, va0, 1);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
@@ -384,7 +621,7 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(pa0 == 0 && (pa0 = vmfault(pagetable, va0, 0)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > len)
@@ -411,7 +648,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(pa0 == 0 && (pa0 = vmfault(pagetable, va0, 0)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > max)
@@ -22,7 +22,7 @@
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int nlog = 2*(LOGSIZE+1);  // two regions, each a header and LOGSIZE blocks
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -40,6 +40,7 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void mkhashdir(uint inum, uint parent, struct dirent *de, int n);
 
 // convert to intel byte order
 ushort
@@ -67,11 +68,10 @@ xint(uint x)
 int
 main(int argc, char *argv[])
 {
-  int i, cc, fd;
-  uint rootino, inum, off;
-  struct dirent de;
+  int i, cc, fd, nroot;
+  uint rootino, inum;
+  struct dirent rootde[NINODES];
   char buf[BSIZE];
-  struct dinode din;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
@@ -83,6 +83,10 @@ main(int argc, char *argv[])
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
+  // unlink() frees a file's blocks in the transaction that also
+  // writes the directory block and two inodes, and the blocks
+  // may be anywhere on the disk.
+  assert((FSSIZE + BPB - 1) / BPB + 3 <= MAXOPBLOCKS);
 
   fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0){
@@ -117,16 +121,7 @@ main(int argc, char *argv[])
 
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  nroot = 0;
 
   for(i = 2; i < argc; i++){
     // get rid of "user/"
@@ -152,10 +147,11 @@ main(int argc, char *argv[])
 
     inum = ialloc(T_FILE);
 
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    assert(nroot < NINODES);
+    bzero(&rootde[nroot], sizeof(rootde[nroot]));
+    rootde[nroot].inum = xshort(inum);
+    strncpy(rootde[nroot].name, shortname, DIRSIZ);
+    nroot++;
 
     while((cc = read(fd, buf, sizeof(buf))) > 0)
       iappend(inum, buf, cc);
@@ -163,12 +159,7 @@ main(int argc, char *argv[])
     close(fd);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  mkhashdir(rootino, rootino, rootde, nroot);
 
   balloc(freeblock);
 
@@ -260,46 +251,184 @@ balloc(int used)
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// mkfs lays each file out in one run of blocks, so it needs
+// few extents: at most those in the inode and the single
+// indirect block, never the double or triple indirect ones.
+#define MAXEXT (NEXTENT + XPB)
+
+// Read the extents of din into x, which has room for
+// MAXEXT, in host byte order. Returns how many there are.
+// There are no double or triple indirect extent blocks.
+int
+rextents(struct dinode *din, struct extent *x)
+{
+  struct extent xb[XPB];
+  int i, n;
+
+  n = 0;
+  for(i = 0; i < NEXTENT && xint(din->ext[i].len) != 0; i++){
+    x[n].start = xint(din->ext[i].start);
+    x[n++].len = xint(din->ext[i].len);
+  }
+  if(i < NEXTENT)
+    return n;
+  assert(xint(din->xaddrs[1]) == 0);
+  if(xint(din->xaddrs[0]) == 0)
+    return n;
+  rsect(xint(din->xaddrs[0]), (char*)xb);
+  for(i = 0; i < XPB && xint(xb[i].len) != 0; i++){
+    x[n].start = xint(xb[i].start);
+    x[n++].len = xint(xb[i].len);
+  }
+  return n;
+}
+
+// Write the n extents in x to din and its single indirect
+// block, allocating that if needed.
+void
+wextents(struct dinode *din, struct extent *x, int n)
+{
+  struct extent xb[XPB];
+  int i;
+
+  for(i = 0; i < NEXTENT; i++){
+    din->ext[i].start = xint(i < n ? x[i].start : 0);
+    din->ext[i].len = xint(i < n ? x[i].len : 0);
+  }
+  assert(n <= MAXEXT);
+  if(n <= NEXTENT)
+    return;
+  if(xint(din->xaddrs[0]) == 0)
+    din->xaddrs[0] = xint(freeblock++);
+  bzero(xb, sizeof(xb));
+  for(i = NEXTENT; i < n; i++){
+    xb[i - NEXTENT].start = xint(x[i].start);
+    xb[i - NEXTENT].len = xint(x[i].len);
+  }
+  wsect(xint(din->xaddrs[0]), (char*)xb);
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
   char *p = (char*)xp;
-  uint fbn, off, n1;
+  uint fbn, off, n1, lbn;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
-  uint x;
+  struct extent x[MAXEXT];
+  int i, nx;
+  uint b;
 
   rinode(inum, &din);
+  nx = rextents(&din, x);
   off = xint(din.size);
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
+    // find fbn's block, or add one at the end.
+    lbn = 0;
+    for(i = 0; i < nx && fbn >= lbn + x[i].len; i++)
+      lbn += x[i].len;
+    if(i < nx){
+      b = x[i].start + (fbn - lbn);
     } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
+      assert(fbn == lbn);
+      b = freeblock++;
+      if(nx > 0 && x[nx-1].start + x[nx-1].len == b){
+        x[nx-1].len++;
+      } else {
+        assert(nx < MAXEXT);
+        x[nx].start = b;
+        x[nx++].len = 1;
       }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
     }
     n1 = min(n, (fbn + 1) * BSIZE - off);
-    rsect(x, buf);
+    rsect(b, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
-    wsect(x, buf);
+    wsect(b, buf);
     n -= n1;
     off += n1;
     p += n1;
   }
+  wextents(&din, x, nx);
   din.size = xint(off);
   winode(inum, &din);
 }
+
+// Split full block b of a hashed directory, as dirsplit() in
+// kernel/fs.c does.
+void
+dirsplit(char *hdr, char *bk, char *nbk, uint b, uint nb)
+{
+  struct dirent *de, *nde;
+  int depth, ld, n, i;
+
+  depth = xshort(DIRDEPTHOF(hdr));
+  n = 0;
+  for(i = 0; i < (1 << depth); i++){
+    if(xshort(DIRIDX(hdr, i)) == b)
+      n++;
+  }
+  for(ld = depth; n > 1; n >>= 1)
+    ld--;
+  if(ld == depth){
+    assert(depth < DIRMAXDEPTH);
+    for(i = 0; i < (1 << depth); i++)
+      DIRIDX(hdr, i + (1 << depth)) = DIRIDX(hdr, i);
+    DIRDEPTHOF(hdr) = xshort(++depth);
+  }
+
+  bzero(nbk, BSIZE);
+  nde = (struct dirent*)nbk;
+  for(de = (struct dirent*)bk; de < (struct dirent*)(bk + BSIZE); de++){
+    if(de->inum != 0 && (dirhash(de->name) >> ld) & 1){
+      *nde++ = *de;
+      bzero(de, sizeof(*de));
+    }
+  }
+  for(i = 0; i < (1 << depth); i++){
+    if(xshort(DIRIDX(hdr, i)) == b && (i >> ld) & 1)
+      DIRIDX(hdr, i) = xshort(nb);
+  }
+}
+
+// Write directory inum, holding "." and "..", with parent
+// parent, and the n entries in de, as a hashed directory.
+void
+mkhashdir(uint inum, uint parent, struct dirent *de, int n)
+{
+  static char blk[1 + (1 << DIRMAXDEPTH)][BSIZE];
+  struct dirent *d;
+  uint b, nblk;
+  int i;
+
+  bzero(blk, sizeof(blk));
+  d = (struct dirent*)blk[0];
+  d[0].inum = xshort(inum);
+  strcpy(d[0].name, ".");
+  d[1].inum = xshort(parent);
+  strcpy(d[1].name, "..");
+  DIRMAGICOF(blk[0]) = xshort(DIRMAGIC);
+  DIRDEPTHOF(blk[0]) = xshort(0);
+  DIRIDX(blk[0], 0) = xshort(1);
+  nblk = 2;
+
+  for(i = 0; i < n; i++){
+    for(;;){
+      b = xshort(DIRIDX(blk[0], dirhash(de[i].name) & ((1 << xshort(DIRDEPTHOF(blk[0]))) - 1)));
+      for(d = (struct dirent*)blk[b]; d < (struct dirent*)blk[b+1]; d++){
+        if(d->inum == 0)
+          break;
+      }
+      if(d < (struct dirent*)blk[b+1])
+        break;
+      assert(nblk < 1 + (1 << DIRMAXDEPTH));
+      dirsplit(blk[0], blk[b], blk[nblk], b, nblk);
+      nblk++;
+    }
+    *d = de[i];
+  }
+
+  iappend(inum, blk, nblk * BSIZE);
+}
@@ -0,0 +1,207 @@
+// Compare malloc() in umalloc.c with the K&R first-fit
+// allocator it replaced, on the same random mix of small and
+// large allocations. Reports throughput in operations per
+// million cycles of the time CSR, and how much heap each
+// needed compared with the most bytes ever live at once.
+// Each allocator runs in its own child, so that each starts
+// with a fresh heap.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define NSLOT 512
+#define NOPS  100000
+
+static inline uint64
+rdtime(void)
+{
+  uint64 x;
+  asm volatile("rdtime %0" : "=r" (x));
+  return x;
+}
+
+// The old allocator, from K&R section 8.7.
+
+typedef long Align;
+
+union krheader {
+  struct {
+    union krheader *ptr;
+    uint size;
+  } s;
+  Align x;
+};
+
+typedef union krheader KRHeader;
+
+static KRHeader base;
+static KRHeader *freep;
+
+void
+krfree(void *ap)
+{
+  KRHeader *bp, *p;
+
+  bp = (KRHeader*)ap - 1;
+  for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
+    if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
+      break;
+  if(bp + bp->s.size == p->s.ptr){
+    bp->s.size += p->s.ptr->s.size;
+    bp->s.ptr = p->s.ptr->s.ptr;
+  } else
+    bp->s.ptr = p->s.ptr;
+  if(p + p->s.size == bp){
+    p->s.size += bp->s.size;
+    p->s.ptr = bp->s.ptr;
+  } else
+    p->s.ptr = bp;
+  freep = p;
+}
+
+static KRHeader*
+krmorecore(uint nu)
+{
+  char *p;
+  KRHeader *hp;
+
+  if(nu < 4096)
+    nu = 4096;
+  p = sbrk(nu * sizeof(KRHeader));
+  if(p == (char*)-1)
+    return 0;
+  hp = (KRHeader*)p;
+  hp->s.size = nu;
+  krfree((void*)(hp + 1));
+  return freep;
+}
+
+void*
+krmalloc(uint nbytes)
+{
+  KRHeader *p, *prevp;
+  uint nunits;
+
+  nunits = (nbytes + sizeof(KRHeader) - 1)/sizeof(KRHeader) + 1;
+  if((prevp = freep) == 0){
+    base.s.ptr = freep = prevp = &base;
+    base.s.size = 0;
+  }
+  for(p = prevp->s.ptr; ; prevp = p, p = p->s.ptr){
+    if(p->s.size >= nunits){
+      if(p->s.size == nunits)
+        prevp->s.ptr = p->s.ptr;
+      else {
+        p->s.size -= nunits;
+        p += p->s.size;
+        p->s.size = nunits;
+      }
+      freep = prevp;
+      return (void*)(p + 1);
+    }
+    if(p == freep)
+      if((p = krmorecore(nunits)) == 0)
+        return 0;
+  }
+}
+
+static uint seed;
+
+static uint
+rand(void)
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 16) & 0x7fff;
+}
+
+// Mostly small blocks, some medium, a few large.
+static uint
+randsize(void)
+{
+  uint r = rand() % 100;
+
+  if(r < 80)
+    return 1 + rand() % 128;
+  if(r < 97)
+    return 129 + rand() % 2048;
+  return 8192 + rand() % 32768;
+}
+
+char *slot[NSLOT];
+uint slotsize[NSLOT];
+
+void
+run(char *name, int kr)
+{
+  uint64 t0, t1;
+  uint live, peak, n, i;
+  char *start;
+  int op;
+
+  seed = 1;
+  live = peak = 0;
+  start = sbrk(0);
+  t0 = rdtime();
+  for(op = 0; op < NOPS; op++){
+    i = rand() % NSLOT;
+    if(slot[i]){
+      if(kr)
+        krfree(slot[i]);
+      else
+        free(slot[i]);
+      slot[i] = 0;
+      live -= slotsize[i];
+    } else {
+      n = randsize();
+      slot[i] = kr ? krmalloc(n) : malloc(n);
+      if(slot[i] == 0){
+        printf("allocbench: %s out of memory\n", name);
+        exit(1);
+      }
+      slot[i][0] = slot[i][n-1] = i;
+      slotsize[i] = n;
+      live += n;
+      if(live > peak)
+        peak = live;
+    }
+  }
+  t1 = rdtime();
+  if(t1 == t0)
+    t1 = t0 + 1;
+
+  printf("%s: %d ops/Mcycle, peak live %d KB, heap %d KB",
+         name, (int)((uint64)NOPS * 1000000 / (t1 - t0)), peak / 1024,
+         (int)(sbrk(0) - start) / 1024);
+
+  for(i = 0; i < NSLOT; i++){
+    if(slot[i]){
+      if(kr)
+        krfree(slot[i]);
+      else
+        free(slot[i]);
+      slot[i] = 0;
+    }
+  }
+  printf(", %d KB after freeing all\n", (int)(sbrk(0) - start) / 1024);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int kr;
+
+  for(kr = 1; kr >= 0; kr--){
+    int pid = fork();
+    if(pid < 0){
+      printf("allocbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      run(kr ? "K&R       " : "size-class", kr);
+      exit(0);
+    }
+    wait(0);
+  }
+  exit(0);
+}
@@ -0,0 +1,81 @@
+// Write and then read back files of growing size, and report
+// the throughput of each. The larger files need the double
+// indirect extent block if their blocks are scattered, and
+// are past what the file system could hold before it had one.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fcntl.h"
+
+char buf[8192];
+
+// Print bytes in ticks as KB/s.
+void
+rate(char *name, uint bytes, int ticks)
+{
+  if(ticks == 0)
+    ticks = 1;
+  printf(" %s %d KB/s", name, bytes / 1024 * 10 / ticks);
+}
+
+void
+bench(uint size)
+{
+  char *name = "bigfilebench.tmp";
+  int fd, t0, t1, t2;
+  uint off;
+
+  unlink(name);
+  fd = open(name, O_CREATE|O_WRONLY);
+  if(fd < 0){
+    printf("bigfilebench: cannot create %s\n", name);
+    exit(1);
+  }
+  t0 = uptime();
+  for(off = 0; off < size; off += sizeof(buf)){
+    ((uint*)buf)[0] = off;
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("bigfilebench: write failed at %d\n", off);
+      exit(1);
+    }
+  }
+  close(fd);
+  t1 = uptime();
+
+  fd = open(name, O_RDONLY);
+  if(fd < 0){
+    printf("bigfilebench: cannot open %s\n", name);
+    exit(1);
+  }
+  for(off = 0; off < size; off += sizeof(buf)){
+    if(read(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("bigfilebench: read failed at %d\n", off);
+      exit(1);
+    }
+    if(((uint*)buf)[0] != off){
+      printf("bigfilebench: wrong data at %d\n", off);
+      exit(1);
+    }
+  }
+  close(fd);
+  t2 = uptime();
+  unlink(name);
+
+  printf("%d KB:", size / 1024);
+  rate("write", size, t1 - t0);
+  rate("read", size, t2 - t1);
+  printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  uint size;
+
+  for(int i = 0; i < sizeof(buf); i++)
+    buf[i] = i;
+  for(size = 64*1024; size <= 16*1024*1024; size *= 4)
+    bench(size);
+  exit(0);
+}
@@ -0,0 +1,38 @@
+// Print the physical memory allocator's free blocks of each
+// size, and how fragmented free memory is: for each order,
+// the share of free memory that lies in blocks too small to
+// satisfy an allocation of that order.
+
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/memstat.h"
+#include "user/user.h"
+
+int
+main(int argc, char *argv[])
+{
+  struct memstat st;
+  int k, j, free, small;
+
+  if(memstat(&st) < 0){
+    fprintf(2, "buddyinfo: memstat failed\n");
+    exit(1);
+  }
+
+  free = st.ncached;
+  for(k = 0; k <= MAXORDER; k++)
+    free += st.nfree[k] << k;
+  printf("%d of %d pages free, %d in per-CPU caches\n",
+         free, st.npages, st.ncached);
+
+  printf("order  KB    free  alloc  fail  unusable\n");
+  for(k = 0; k <= MAXORDER; k++){
+    // cached pages are single pages too.
+    small = st.ncached;
+    for(j = 0; j < k; j++)
+      small += st.nfree[j] << j;
+    printf("%d\t%d\t%d\t%d\t%d\t%d%%\n", k, 4 << k, st.nfree[k],
+           st.nalloc[k], st.nfail[k], free ? small * 100 / free : 0);
+  }
+  exit(0);
+}
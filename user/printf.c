@@ -1,15 +1,68 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
+#include "kernel/param.h"
 #include "user/user.h"
 
 #include <stdarg.h>
 
+// Output is buffered per file descriptor, and written when
+// the buffer fills, or for a device (the console) at the end
+// of each line. Output to fd 2 is written at the end of each
+// printf, so that prompts appear. fork(), exec(), close() and
+// exit() are wrapped below to write out what is buffered.
+
+#define OUTBUFSZ 512
+
+enum { UNKNOWN, LINEBUF, FULLBUF };
+
+static struct {
+  int mode;
+  int n;
+  char buf[OUTBUFSZ];
+} out[NOFILE];
+
+int _fork(void);
+int _exit(int) __attribute__((noreturn));
+int _close(int);
+int _exec(char*, char**);
+
 static char digits[] = "0123456789ABCDEF";
 
+// Write out fd's buffered output.
+void
+fflush(int fd)
+{
+  if(fd < 0 || fd >= NOFILE || out[fd].n == 0)
+    return;
+  write(fd, out[fd].buf, out[fd].n);
+  out[fd].n = 0;
+}
+
+static void
+fflushall(void)
+{
+  for(int fd = 0; fd < NOFILE; fd++)
+    fflush(fd);
+}
+
 static void
 putc(int fd, char c)
 {
-  write(fd, &c, 1);
+  struct stat st;
+
+  if(fd < 0 || fd >= NOFILE){
+    write(fd, &c, 1);
+    return;
+  }
+  if(out[fd].mode == UNKNOWN){
+    if(fstat(fd, &st) == 0 && st.type == T_DEVICE)
+      out[fd].mode = LINEBUF;
+    else
+      out[fd].mode = FULLBUF;
+  }
+  out[fd].buf[out[fd].n++] = c;
+  if(out[fd].n == OUTBUFSZ || (c == '\n' && out[fd].mode == LINEBUF))
+    fflush(fd);
 }
 
 static void
@@ -92,6 +145,8 @@ vprintf(int fd, const char *fmt, va_list ap)
       state = 0;
     }
   }
+  if(fd == 2)
+    fflush(fd);
 }
 
 void
@@ -111,3 +166,34 @@ printf(const char *fmt, ...)
   va_start(ap, fmt);
   vprintf(1, fmt, ap);
 }
+
+int
+fork(void)
+{
+  fflushall();
+  return _fork();
+}
+
+int
+exit(int status)
+{
+  fflushall();
+  _exit(status);
+}
+
+int
+close(int fd)
+{
+  if(fd >= 0 && fd < NOFILE){
+    fflush(fd);
+    out[fd].mode = UNKNOWN;
+  }
+  return _close(fd);
+}
+
+int
+exec(char *path, char **argv)
+{
+  fflushall();
+  return _exec(path, argv);
+}
@@ -0,0 +1,199 @@
+// Test splice(), and compare its throughput moving a file
+// into a pipe with that of a read()/write() loop.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fcntl.h"
+
+#define FILESZ (64*1024)
+#define PASSES 32
+
+char buf[4096];
+
+uint
+checksum(uint sum, char *p, int n)
+{
+  for(int i = 0; i < n; i++)
+    sum = sum * 31 + (uchar)p[i];
+  return sum;
+}
+
+void
+fill(char *p, int off, int n)
+{
+  for(int i = 0; i < n; i++)
+    p[i] = (off + i) % 251;
+}
+
+void
+mkdata(char *name)
+{
+  int fd, off;
+
+  unlink(name);
+  if((fd = open(name, O_CREATE|O_WRONLY)) < 0){
+    printf("splicetest: cannot create %s\n", name);
+    exit(1);
+  }
+  for(off = 0; off < FILESZ; off += sizeof(buf)){
+    fill(buf, off, sizeof(buf));
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("splicetest: write %s failed\n", name);
+      exit(1);
+    }
+  }
+  close(fd);
+}
+
+// Send PASSES copies of the file down a pipe, by splice() or
+// by read() and write(), to a child that checks them.
+void
+send(char *name, int usesplice)
+{
+  int p[2], res[2], fd, n, pid, t0, t1;
+  uint sum, want, got[2];
+
+  if(pipe(p) < 0 || pipe(res) < 0){
+    printf("splicetest: pipe failed\n");
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("splicetest: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(p[1]);
+    close(res[0]);
+    got[0] = got[1] = 0;
+    while((n = read(p[0], buf, sizeof(buf))) > 0){
+      got[0] += n;
+      got[1] = checksum(got[1], buf, n);
+    }
+    write(res[1], got, sizeof(got));
+    exit(0);
+  }
+  close(p[0]);
+  close(res[1]);
+
+  t0 = uptime();
+  for(int i = 0; i < PASSES; i++){
+    if((fd = open(name, O_RDONLY)) < 0){
+      printf("splicetest: cannot open %s\n", name);
+      exit(1);
+    }
+    if(usesplice){
+      while((n = splice(fd, p[1], FILESZ)) > 0)
+        ;
+    } else {
+      while((n = read(fd, buf, sizeof(buf))) > 0){
+        if(write(p[1], buf, n) != n){
+          n = -1;
+          break;
+        }
+      }
+    }
+    close(fd);
+    if(n < 0){
+      printf("splicetest: %s failed\n", usesplice ? "splice" : "write");
+      exit(1);
+    }
+  }
+  close(p[1]);
+  if(read(res[0], got, sizeof(got)) != sizeof(got)){
+    printf("splicetest: no result from reader\n");
+    exit(1);
+  }
+  close(res[0]);
+  wait(0);
+  t1 = uptime();
+
+  want = 0;
+  for(int i = 0; i < PASSES; i++){
+    for(int off = 0; off < FILESZ; off += sizeof(buf)){
+      fill(buf, off, sizeof(buf));
+      want = checksum(want, buf, sizeof(buf));
+    }
+  }
+  if(got[0] != PASSES*FILESZ || got[1] != want){
+    printf("splicetest: reader got %d bytes, bad data\n", got[0]);
+    exit(1);
+  }
+
+  sum = PASSES*FILESZ;
+  if(t1 == t0)
+    t1 = t0 + 1;
+  printf("%s: %d bytes in %d ticks, %d KB/s\n",
+         usesplice ? "splice    " : "read/write", sum, t1 - t0,
+         sum / 1024 * 10 / (t1 - t0));
+}
+
+// splice() from a pipe into a file.
+void
+receive(char *name)
+{
+  int p[2], fd, n, off, pid;
+  char want[sizeof(buf)];
+
+  if(pipe(p) < 0){
+    printf("splicetest: pipe failed\n");
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("splicetest: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(p[0]);
+    for(off = 0; off < FILESZ; off += 1000){
+      n = FILESZ - off < 1000 ? FILESZ - off : 1000;
+      fill(buf, off, n);
+      write(p[1], buf, n);
+    }
+    exit(0);
+  }
+  close(p[1]);
+
+  unlink(name);
+  if((fd = open(name, O_CREATE|O_WRONLY)) < 0){
+    printf("splicetest: cannot create %s\n", name);
+    exit(1);
+  }
+  off = 0;
+  while((n = splice(p[0], fd, FILESZ)) > 0)
+    off += n;
+  close(fd);
+  close(p[0]);
+  wait(0);
+  if(n < 0 || off != FILESZ){
+    printf("splicetest: spliced %d bytes into file\n", off);
+    exit(1);
+  }
+
+  fd = open(name, O_RDONLY);
+  for(off = 0; off < FILESZ; off += n){
+    n = read(fd, buf, sizeof(buf));
+    fill(want, off, sizeof(want));
+    if(n <= 0 || memcmp(buf, want, n) != 0){
+      printf("splicetest: file has wrong data at %d\n", off);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink(name);
+}
+
+int
+main(int argc, char *argv[])
+{
+  printf("splicetest starting\n");
+  mkdata("splicedata");
+  receive("spliceout");
+  send("splicedata", 0);
+  send("splicedata", 1);
+  unlink("splicedata");
+  printf("splicetest OK\n");
+  exit(0);
+}
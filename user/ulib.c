@@ -32,14 +32,37 @@ strlen(const char *s)
   return n;
 }
 
+// memset, memmove and memcmp work a 64-bit word at a time
+// once the pointers are aligned; see kernel/string.c.
+#define WSIZE sizeof(uint64)
+#define ALIGNED(p) (((uint64)(p) & (WSIZE-1)) == 0)
+
 void*
 memset(void *dst, int c, uint n)
 {
   char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uint64 w, *wdst;
+
+  while(n > 0 && !ALIGNED(cdst)){
+    *cdst++ = c;
+    n--;
+  }
+  w = (uchar)c;
+  w |= w << 8;
+  w |= w << 16;
+  w |= w << 32;
+  wdst = (uint64 *) cdst;
+  for(; n >= 4*WSIZE; n -= 4*WSIZE, wdst += 4){
+    wdst[0] = w;
+    wdst[1] = w;
+    wdst[2] = w;
+    wdst[3] = w;
   }
+  for(; n >= WSIZE; n -= WSIZE)
+    *wdst++ = w;
+  cdst = (char *) wdst;
+  while(n-- > 0)
+    *cdst++ = c;
   return dst;
 }
 
@@ -52,16 +75,33 @@ strchr(const char *s, char c)
   return 0;
 }
 
+// Input that gets() has read from fd 0 but not yet returned.
+// Only a device (the console) is read ahead, since a console
+// read returns at most one line anyway; a file or pipe is
+// still read a byte at a time, so that bytes past the line
+// are left for any child process that shares it.
+static char inbuf[128];
+static int inpos, inlen;
+static int indev = -1;
+
 char*
 gets(char *buf, int max)
 {
   int i, cc;
   char c;
+  struct stat st;
 
+  if(indev < 0)
+    indev = (fstat(0, &st) == 0 && st.type == T_DEVICE);
   for(i=0; i+1 < max; ){
-    cc = read(0, &c, 1);
-    if(cc < 1)
-      break;
+    if(inpos == inlen){
+      cc = read(0, inbuf, indev ? sizeof(inbuf) : 1);
+      if(cc < 1)
+        break;
+      inpos = 0;
+      inlen = cc;
+    }
+    c = inbuf[inpos++];
     buf[i++] = c;
     if(c == '\n' || c == '\r')
       break;
@@ -95,20 +135,94 @@ atoi(const char *s)
   return n;
 }
 
+// Copy n bytes forwards from src to dst, where dst is
+// aligned and src is not, by shifting aligned source words
+// into place.
+static void
+shiftcopy(char *dst, const char *src, int n)
+{
+  int sh = ((uint64)src & (WSIZE-1)) * 8;
+  const uint64 *ws = (const uint64 *) (src - sh/8);
+  uint64 *wd = (uint64 *) dst;
+  uint64 lo, hi;
+
+  if(n >= WSIZE){
+    lo = *ws++;
+    for(; n >= WSIZE; n -= WSIZE){
+      hi = *ws++;
+      *wd++ = (lo >> sh) | (hi << (64 - sh));
+      lo = hi;
+    }
+    dst = (char *) wd;
+    src = (const char *) ws - WSIZE + sh/8;
+  }
+  while(n-- > 0)
+    *dst++ = *src++;
+}
+
 void*
 memmove(void *vdst, const void *vsrc, int n)
 {
   char *dst;
   const char *src;
+  uint64 w0, w1, w2, w3;
 
   dst = vdst;
   src = vsrc;
   if (src > dst) {
+    while(n > 0 && !ALIGNED(dst)){
+      *dst++ = *src++;
+      n--;
+    }
+    if(!ALIGNED(src)){
+      shiftcopy(dst, src, n);
+      return vdst;
+    }
+    for(; n >= 4*WSIZE; n -= 4*WSIZE){
+      w0 = ((uint64*)src)[0];
+      w1 = ((uint64*)src)[1];
+      w2 = ((uint64*)src)[2];
+      w3 = ((uint64*)src)[3];
+      ((uint64*)dst)[0] = w0;
+      ((uint64*)dst)[1] = w1;
+      ((uint64*)dst)[2] = w2;
+      ((uint64*)dst)[3] = w3;
+      src += 4*WSIZE;
+      dst += 4*WSIZE;
+    }
+    for(; n >= WSIZE; n -= WSIZE){
+      *(uint64*)dst = *(uint64*)src;
+      src += WSIZE;
+      dst += WSIZE;
+    }
     while(n-- > 0)
       *dst++ = *src++;
   } else {
     dst += n;
     src += n;
+    if(((uint64)src ^ (uint64)dst) % WSIZE == 0){
+      while(n > 0 && !ALIGNED(dst)){
+        *--dst = *--src;
+        n--;
+      }
+      for(; n >= 4*WSIZE; n -= 4*WSIZE){
+        src -= 4*WSIZE;
+        dst -= 4*WSIZE;
+        w0 = ((uint64*)src)[0];
+        w1 = ((uint64*)src)[1];
+        w2 = ((uint64*)src)[2];
+        w3 = ((uint64*)src)[3];
+        ((uint64*)dst)[3] = w3;
+        ((uint64*)dst)[2] = w2;
+        ((uint64*)dst)[1] = w1;
+        ((uint64*)dst)[0] = w0;
+      }
+      for(; n >= WSIZE; n -= WSIZE){
+        src -= WSIZE;
+        dst -= WSIZE;
+        *(uint64*)dst = *(uint64*)src;
+      }
+    }
     while(n-- > 0)
       *--dst = *--src;
   }
@@ -119,6 +233,16 @@ int
 memcmp(const void *s1, const void *s2, uint n)
 {
   const char *p1 = s1, *p2 = s2;
+  if (((uint64)p1 ^ (uint64)p2) % WSIZE == 0) {
+    while (n > 0 && !ALIGNED(p1)) {
+      if (*p1 != *p2)
+        return *p1 - *p2;
+      p1++, p2++, n--;
+    }
+    // skip equal words; the bytes below find the difference.
+    while (n >= WSIZE && *(uint64*)p1 == *(uint64*)p2)
+      p1 += WSIZE, p2 += WSIZE, n -= WSIZE;
+  }
   while (n-- > 0) {
     if (*p1 != *p2) {
       return *p1 - *p2;
@@ -3,88 +3,277 @@
 #include "user/user.h"
 #include "kernel/param.h"
 
-// Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.  Section 8.7.
+// Memory allocator with segregated size classes.
+//
+// Every block starts with a 16-byte header. Small requests
+// are rounded up to one of a few size classes, each with its
+// own free list, so malloc() and free() of a small block just
+// pop or push a list. A class whose list is empty is refilled
+// by carving up a slab obtained from the large allocator;
+// slabs stay with their class.
+//
+// Larger blocks tile the heap obtained from sbrk(). Each
+// header records the size of the block and of the block before
+// it, so free() can coalesce with both neighbours. Free large
+// blocks are kept in bins by power-of-two size. Each stretch of
+// heap ends with a small in-use fence block, so coalescing
+// stops there even if someone else moved the break with sbrk().
+// When a large free block at the top of the heap grows past
+// TRIMSIZE, most of it is handed back to the kernel with a
+// negative sbrk().
 
-typedef long Align;
+#define PGSIZE    4096
+#define HDRSIZE   16
+#define MINLARGE  32           // header + free list links
+#define MINCORE   (64*1024)    // least to ask sbrk() for
+#define TRIMSIZE  (128*1024)   // free top block that is trimmed
+#define NBIN      32
 
-union header {
-  struct {
-    union header *ptr;
-    uint size;
-  } s;
-  Align x;
-};
+enum { FREE, LARGE, FENCE, SMALL };  // tag; SMALL+c is class c
 
-typedef union header Header;
+typedef struct header {
+  uint size;      // bytes in block, including header
+  uint prevsize;  // size of the block before it, or 0
+  uint tag;
+  uint pad;
+} Header;
 
-static Header base;
-static Header *freep;
+// a free large block, or a free small block (next only).
+typedef struct fblock {
+  Header h;
+  struct fblock *next;
+  struct fblock *prev;
+} Fblock;
 
-void
-free(void *ap)
+// block sizes of the small classes, including the header.
+static uint classsize[] = { 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024 };
+#define NCLASS (sizeof(classsize)/sizeof(classsize[0]))
+#define MAXSMALL 1024
+
+static Fblock *smallfree[NCLASS];
+static Fblock *bins[NBIN];
+static char *heapend;     // program break after our last sbrk()
+static Header *topfence;  // fence of the stretch ending there
+
+static Header*
+nextblock(Header *h)
 {
-  Header *bp, *p;
-
-  bp = (Header*)ap - 1;
-  for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
-    if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
-      break;
-  if(bp + bp->s.size == p->s.ptr){
-    bp->s.size += p->s.ptr->s.size;
-    bp->s.ptr = p->s.ptr->s.ptr;
-  } else
-    bp->s.ptr = p->s.ptr;
-  if(p + p->s.size == bp){
-    p->s.size += bp->s.size;
-    p->s.ptr = bp->s.ptr;
-  } else
-    p->s.ptr = bp;
-  freep = p;
+  return (Header*)((char*)h + h->size);
 }
 
 static Header*
-morecore(uint nu)
+prevblock(Header *h)
+{
+  return (Header*)((char*)h - h->prevsize);
+}
+
+static int
+binof(uint size)
+{
+  int i = 0;
+
+  while(size > 1 && i < NBIN-1){
+    size >>= 1;
+    i++;
+  }
+  return i;
+}
+
+static void
+binremove(Fblock *b)
+{
+  if(b->prev)
+    b->prev->next = b->next;
+  else
+    bins[binof(b->h.size)] = b->next;
+  if(b->next)
+    b->next->prev = b->prev;
+}
+
+static void
+bininsert(Fblock *b)
+{
+  int i = binof(b->h.size);
+
+  b->h.tag = FREE;
+  b->prev = 0;
+  b->next = bins[i];
+  if(bins[i])
+    bins[i]->prev = b;
+  bins[i] = b;
+}
+
+// Free large block h, merging it with free neighbours, and
+// give the top of the heap back to the kernel if it has
+// grown large.
+static void
+largefree(Header *h)
+{
+  Header *n, *p;
+  uint rel;
+
+  n = nextblock(h);
+  if(n->tag == FREE){
+    binremove((Fblock*)n);
+    h->size += n->size;
+  }
+  if(h->prevsize && (p = prevblock(h))->tag == FREE){
+    binremove((Fblock*)p);
+    p->size += h->size;
+    h = p;
+  }
+  n = nextblock(h);
+  n->prevsize = h->size;
+
+  if(n == topfence && h->size >= TRIMSIZE && sbrk(0) == heapend){
+    rel = (h->size - PGSIZE) & ~(PGSIZE-1);
+    if(sbrk(-rel) != (char*)-1){
+      heapend -= rel;
+      h->size -= rel;
+      n = topfence = nextblock(h);
+      n->size = HDRSIZE;
+      n->prevsize = h->size;
+      n->tag = FENCE;
+    }
+  }
+  bininsert((Fblock*)h);
+}
+
+// Get at least size more bytes of heap from the kernel, and
+// add them to the free large blocks.
+static int
+morecore(uint size)
 {
   char *p;
-  Header *hp;
+  uint64 n;
+  Header *h, *fence;
 
-  if(nu < 4096)
-    nu = 4096;
-  p = sbrk(nu * sizeof(Header));
+  n = ((uint64)size + HDRSIZE + PGSIZE - 1) & ~(uint64)(PGSIZE-1);
+  if(n < MINCORE)
+    n = MINCORE;
+  // sbrk() takes an int, and would shrink the heap.
+  if(n > 0x7fffffff)
+    return -1;
+  p = sbrk(n);
   if(p == (char*)-1)
-    return 0;
-  hp = (Header*)p;
-  hp->s.size = nu;
-  free((void*)(hp + 1));
-  return freep;
+    return -1;
+  if(topfence && p == heapend){
+    // extends the last stretch; its fence joins the new block.
+    h = topfence;
+  } else {
+    // a new stretch, aligned.
+    h = (Header*)(((uint64)p + HDRSIZE - 1) & ~(uint64)(HDRSIZE-1));
+    h->prevsize = 0;
+  }
+  heapend = p + n;
+  h->size = ((heapend - (char*)h) & ~(HDRSIZE-1)) - HDRSIZE;
+  h->tag = LARGE;
+  fence = topfence = nextblock(h);
+  fence->size = HDRSIZE;
+  fence->prevsize = h->size;
+  fence->tag = FENCE;
+  largefree(h);
+  return 0;
 }
 
-void*
-malloc(uint nbytes)
+// Allocate a large block of size bytes, including the header.
+static Header*
+largealloc(uint size)
 {
-  Header *p, *prevp;
-  uint nunits;
+  Fblock *b;
+  Header *h, *r;
+  int i;
 
-  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
-  if((prevp = freep) == 0){
-    base.s.ptr = freep = prevp = &base;
-    base.s.size = 0;
-  }
-  for(p = prevp->s.ptr; ; prevp = p, p = p->s.ptr){
-    if(p->s.size >= nunits){
-      if(p->s.size == nunits)
-        prevp->s.ptr = p->s.ptr;
-      else {
-        p->s.size -= nunits;
-        p += p->s.size;
-        p->s.size = nunits;
+  for(;;){
+    for(i = binof(size); i < NBIN; i++){
+      for(b = bins[i]; b; b = b->next){
+        if(b->h.size >= size)
+          goto found;
       }
-      freep = prevp;
-      return (void*)(p + 1);
     }
-    if(p == freep)
-      if((p = morecore(nunits)) == 0)
-        return 0;
+    if(morecore(size) < 0)
+      return 0;
+  }
+
+ found:
+  binremove(b);
+  h = &b->h;
+  if(h->size - size >= MINLARGE){
+    // split, freeing the rest.
+    r = (Header*)((char*)h + size);
+    r->size = h->size - size;
+    r->prevsize = size;
+    nextblock(r)->prevsize = r->size;
+    h->size = size;
+    bininsert((Fblock*)r);
   }
+  h->tag = LARGE;
+  return h;
+}
+
+// Refill the free list of small class c from a new slab.
+static int
+refill(int c)
+{
+  uint csize = classsize[c];
+  uint n = PGSIZE;
+  Header *slab, *h;
+  char *p;
+
+  if(n < 8 * csize)
+    n = 8 * csize;
+  if((slab = largealloc(n + HDRSIZE)) == 0)
+    return -1;
+  for(p = (char*)(slab + 1); p + csize <= (char*)slab + slab->size; p += csize){
+    h = (Header*)p;
+    h->size = csize;
+    h->tag = SMALL + c;
+    ((Fblock*)h)->next = smallfree[c];
+    smallfree[c] = (Fblock*)h;
+  }
+  return 0;
+}
+
+void
+free(void *ap)
+{
+  Header *h;
+  int c;
+
+  if(ap == 0)
+    return;
+  h = (Header*)ap - 1;
+  if(h->tag >= SMALL){
+    c = h->tag - SMALL;
+    ((Fblock*)h)->next = smallfree[c];
+    smallfree[c] = (Fblock*)h;
+  } else {
+    largefree(h);
+  }
+}
+
+void*
+malloc(uint nbytes)
+{
+  Header *h;
+  uint size;
+  int c;
+
+  // leave room for the header, and for morecore()'s fence
+  // and page rounding, within what sbrk() can grow by.
+  if(nbytes > 0x7fffffff - 2*PGSIZE - 2*HDRSIZE)
+    return 0;
+  size = (nbytes + HDRSIZE + HDRSIZE - 1) & ~(HDRSIZE-1);
+  if(size <= MAXSMALL){
+    for(c = 0; classsize[c] < size; c++)
+      ;
+    if(smallfree[c] == 0 && refill(c) < 0)
+      return 0;
+    h = &smallfree[c]->h;
+    smallfree[c] = smallfree[c]->next;
+    return (void*)(h + 1);
+  }
+  if((h = largealloc(size)) == 0)
+    return 0;
+  return (void*)(h + 1);
 }
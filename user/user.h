@@ -1,5 +1,6 @@
 struct stat;
 struct rtcdate;
+struct memstat;
 
 // system calls
 int fork(void);
@@ -23,6 +24,11 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+void* mmap(void*, uint, int, int, int, uint);
+int munmap(void*, uint);
+int msleep(int);
+int splice(int, int, int);
+int memstat(struct memstat*);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -32,6 +38,7 @@ char* strchr(const char*, char c);
 int strcmp(const char*, const char*);
 void fprintf(int, const char*, ...);
 void printf(const char*, ...);
+void fflush(int);
 char* gets(char*, int max);
 uint strlen(const char*);
 void* memset(void*, int, uint);
@@ -7,6 +7,7 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/memstat.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -523,6 +524,10 @@ writetest(char *s)
   }
 }
 
+// a file that needs the double indirect extent block, even
+// if balloc() had to give it a new extent for every block.
+#define BIGBLOCKS (NEXTENT + XPB + 2*XPB)
+
 void
 writebig(char *s)
 {
@@ -534,7 +539,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < BIGBLOCKS; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed\n", i);
@@ -554,7 +559,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n != BIGBLOCKS){
         printf("%s: read only %d blocks from big", n);
         exit(1);
       }
@@ -577,6 +582,57 @@ writebig(char *s)
   }
 }
 
+// two files written a block at a time in turn have their
+// blocks interleaved on disk, so each needs many extents,
+// more than fit in the inode.
+void
+extentfrag(char *s)
+{
+  enum { N = 200 };
+  int fd[2], i, j, k;
+
+  for(j = 0; j < 2; j++){
+    fd[j] = open(j ? "xfrag1" : "xfrag0", O_CREATE|O_RDWR);
+    if(fd[j] < 0){
+      printf("%s: create failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    for(j = 0; j < 2; j++){
+      for(k = 0; k < BSIZE/sizeof(int); k++)
+        ((int*)buf)[k] = i * 2 + j + k;
+      if(write(fd[j], buf, BSIZE) != BSIZE){
+        printf("%s: write block %d failed\n", s, i);
+        exit(1);
+      }
+    }
+  }
+  for(j = 0; j < 2; j++){
+    close(fd[j]);
+    fd[j] = open(j ? "xfrag1" : "xfrag0", O_RDONLY);
+    for(i = 0; i < N; i++){
+      if(read(fd[j], buf, BSIZE) != BSIZE){
+        printf("%s: read block %d failed\n", s, i);
+        exit(1);
+      }
+      for(k = 0; k < BSIZE/sizeof(int); k++){
+        if(((int*)buf)[k] != i * 2 + j + k){
+          printf("%s: block %d has wrong content\n", s, i);
+          exit(1);
+        }
+      }
+    }
+    if(read(fd[j], buf, BSIZE) != 0){
+      printf("%s: file too long\n", s);
+      exit(1);
+    }
+    close(fd[j]);
+  }
+  unlink("xfrag0");
+  unlink("xfrag1");
+}
+
 // many creates, followed by unlink test
 void
 createtest(char *s)
@@ -680,6 +736,85 @@ exectest(char *s)
 
 }
 
+// program text is read-only, and the initialized data of a
+// program is private to each process running it, also when
+// several run at once and share the text pages.
+int execdata = 7;
+
+void
+execshare(char *s)
+{
+  int fds[2], pid, xstatus, i, n, total;
+  char *echoargv[] = { "echo", "ok", 0 };
+  char buf[32];
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    *(volatile char *)(uint64)execshare = 0;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: wrote to program text\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    execdata = 8;
+    exit(execdata == 8 ? 0 : 1);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || execdata != 7){
+    printf("%s: data not private\n", s);
+    exit(1);
+  }
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 4; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(1);
+      dup(fds[1]);
+      close(fds[0]);
+      close(fds[1]);
+      exec("echo", echoargv);
+      exit(1);
+    }
+  }
+  close(fds[1]);
+  total = 0;
+  while((n = read(fds[0], buf + total, sizeof(buf) - total)) > 0)
+    total += n;
+  close(fds[0]);
+  for(i = 0; i < 4; i++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: exec echo failed\n", s);
+      exit(1);
+    }
+  }
+  if(total != 12 || memcmp(buf, "ok\nok\nok\nok\n", 12) != 0){
+    printf("%s: wrong output\n", s);
+    exit(1);
+  }
+}
+
 // simple fork and pipe read/write
 
 void
@@ -735,6 +870,57 @@ pipe1(char *s)
   }
 }
 
+// writes larger than the pipe's buffer, read back
+// in pieces that don't line up with the writes.
+void
+pipebig(char *s)
+{
+  int fds[2], pid, xstatus;
+  int seq, i, n, total;
+  enum { N=8, CC=777 };
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork() failed\n", s);
+    exit(1);
+  }
+  seq = 0;
+  if(pid == 0){
+    close(fds[0]);
+    for(n = 0; n < N; n++){
+      for(i = 0; i < sizeof(buf); i++)
+        buf[i] = seq++ % 251;
+      if(write(fds[1], buf, sizeof(buf)) != sizeof(buf)){
+        printf("%s: short write\n", s);
+        exit(1);
+      }
+    }
+    exit(0);
+  }
+  close(fds[1]);
+  total = 0;
+  while((n = read(fds[0], buf, CC)) > 0){
+    for(i = 0; i < n; i++){
+      if((buf[i] & 0xff) != seq++ % 251){
+        printf("%s: wrong data at %d\n", s, total + i);
+        exit(1);
+      }
+    }
+    total += n;
+  }
+  close(fds[0]);
+  if(total != N * sizeof(buf)){
+    printf("%s: total %d\n", s, total);
+    exit(1);
+  }
+  wait(&xstatus);
+  exit(xstatus);
+}
+
 // meant to be run w/ at most two CPUs
 void
 preempt(char *s)
@@ -1006,6 +1192,424 @@ mem(char *s)
   }
 }
 
+// fork a process with a large heap, and check that the
+// parent and child each see their own writes, both from
+// user stores and from the kernel's copyout() (read()).
+void
+cowfork(char *s)
+{
+  int sz = 16*1024*1024;
+  char *p = sbrk(sz);
+  int fds[2];
+
+  if(p == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < sz; i += 4096)
+    p[i] = 'p';
+
+  for(int n = 0; n < 3; n++){
+    if(pipe(fds) < 0){
+      printf("%s: pipe failed\n", s);
+      exit(1);
+    }
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(fds[1]);
+      for(int i = 0; i < sz; i += 4096){
+        if(p[i] != 'p'){
+          printf("%s: child saw wrong data\n", s);
+          exit(1);
+        }
+        p[i] = 'c';
+      }
+      if(read(fds[0], p + 4096, 1) != 1 || p[4096] != 'x'){
+        printf("%s: read into shared page failed\n", s);
+        exit(1);
+      }
+      exit(0);
+    }
+    close(fds[0]);
+    if(write(fds[1], "x", 1) != 1){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+    close(fds[1]);
+    int xstatus;
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
+    for(int i = 0; i < sz; i += 4096){
+      if(p[i] != 'p'){
+        printf("%s: parent saw child's write\n", s);
+        exit(1);
+      }
+    }
+  }
+  sbrk(-sz);
+}
+
+// sbrk() a heap far larger than physical memory, which only
+// works if pages are allocated when first touched, and check
+// that system calls can read and write untouched heap pages.
+void
+lazyalloc(char *s)
+{
+  int sz = 1024*1024*1024;
+  char *p = sbrk(sz);
+  int fd;
+
+  if(p == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < sz; i += 64*1024*1024)
+    p[i] = 'a' + (i >> 26);
+  for(int i = 0; i < sz; i += 64*1024*1024){
+    if(p[i] != 'a' + (i >> 26) || p[i+1] != 0){
+      printf("%s: bad heap contents\n", s);
+      exit(1);
+    }
+  }
+
+  fd = open("lazyalloc", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  if(write(fd, p + sz - 8192, 8192) != 8192){
+    printf("%s: write from untouched heap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("lazyalloc", O_RDONLY);
+  if(read(fd, p + sz/2 + 100, 8192) != 8192){
+    printf("%s: read into untouched heap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("lazyalloc");
+
+  if(sbrk(-sz) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk shrink failed\n", s);
+    exit(1);
+  }
+}
+
+// a heap big enough for megapages: check that fork() shares
+// them copy-on-write, and that shrinking the heap to the
+// middle of one splits it.
+void
+megaheap(char *s)
+{
+  enum { SZ = 8*1024*1024, CUT = SZ/2 + 3*PGSIZE };
+  char *p;
+  int i, pid, xstatus;
+
+  p = sbrk(0);
+  sbrk(PGROUNDUP((uint64)p) - (uint64)p);  // page-align the heap top
+  p = sbrk(SZ);
+  if(p == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i += PGSIZE)
+    p[i] = i / PGSIZE;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < SZ; i += PGSIZE){
+      if(p[i] != (char)(i / PGSIZE)){
+        printf("%s: child sees wrong heap contents\n", s);
+        exit(1);
+      }
+      p[i] = 0x55;
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  for(i = 0; i < SZ; i += PGSIZE){
+    if(p[i] != (char)(i / PGSIZE)){
+      printf("%s: child's writes reached the parent\n", s);
+      exit(1);
+    }
+  }
+
+  if(sbrk(-CUT) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk shrink failed\n", s);
+    exit(1);
+  }
+  if(sbrk(CUT) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk grow failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i += PGSIZE){
+    if(p[i] != (i < SZ - CUT ? (char)(i / PGSIZE) : 0)){
+      printf("%s: bad heap contents after shrinking\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-SZ);
+}
+
+// free pages reported by memstat().
+int
+memfree(struct memstat *st)
+{
+  int n;
+
+  if(memstat(st) < 0){
+    printf("memstat failed\n");
+    exit(1);
+  }
+  n = st->ncached;
+  for(int k = 0; k <= MAXORDER; k++)
+    n += st->nfree[k] << k;
+  return n;
+}
+
+// grow the heap a page at a time, so it gets 4 KB pages,
+// free it all, and check that memstat() sees the pages
+// leave and come back.
+void
+buddystat(char *s)
+{
+  enum { N = 2048 };
+  struct memstat st;
+  int free0, free1, i;
+  char *p;
+
+  free0 = memfree(&st);
+  if(free0 <= 0 || free0 > st.npages){
+    printf("%s: memstat says %d of %d pages free\n", s, free0, st.npages);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    p = sbrk(PGSIZE);
+    if(p == (char*)0xffffffffffffffffL){
+      printf("%s: sbrk failed\n", s);
+      exit(1);
+    }
+    *p = 1;
+  }
+  free1 = memfree(&st);
+  if(free1 > free0 - N){
+    printf("%s: %d pages free before, %d after allocating %d\n", s, free0, free1, N);
+    exit(1);
+  }
+  sbrk(-N*PGSIZE);
+  free1 = memfree(&st);
+  // page-table pages stay until exit.
+  if(free1 < free0 - 16){
+    printf("%s: %d pages free before, %d after freeing\n", s, free0, free1);
+    exit(1);
+  }
+}
+
+// map a file, read it through the mapping, write through a
+// shared mapping, and check that the writes reach the file
+// and are seen by a forked child.
+void
+mmapfile(char *s)
+{
+  int fd, n = PGSIZE*2 + PGSIZE/2;
+  char *p;
+
+  unlink("mmapfile");
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < n; i++){
+    char c = 'a' + i % 26;
+    if(write(fd, &c, 1) != 1){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+
+  p = mmap(0, PGSIZE*3, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < PGSIZE*3; i++){
+    if(p[i] != (i < n ? 'a' + i % 26 : 0)){
+      printf("%s: bad mapped data at %d\n", s, i);
+      exit(1);
+    }
+  }
+  if(munmap(p, PGSIZE*3) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  p = mmap(0, n, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  p[0] = 'X';
+  p[PGSIZE*2 + 10] = 'Y';
+
+  int pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(p[0] != 'X' || p[PGSIZE*2 + 10] != 'Y')
+      exit(1);
+    p[PGSIZE] = 'Z';
+    exit(0);
+  }
+  int xstatus;
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong data\n", s);
+    exit(1);
+  }
+  if(p[PGSIZE] != 'Z'){
+    printf("%s: parent didn't see child's write\n", s);
+    exit(1);
+  }
+  if(munmap(p, PGSIZE) < 0 || munmap(p + PGSIZE, n - PGSIZE) < 0){
+    printf("%s: munmap shared failed\n", s);
+    exit(1);
+  }
+
+  char b[3];
+  fd = open("mmapfile", O_RDONLY);
+  read(fd, &b[0], 1);
+  read(fd, buf, PGSIZE - 1);
+  read(fd, &b[1], 1);
+  read(fd, buf, PGSIZE + 9);
+  read(fd, &b[2], 1);
+  close(fd);
+  if(b[0] != 'X' || b[1] != 'Z' || b[2] != 'Y'){
+    printf("%s: writes didn't reach the file\n", s);
+    exit(1);
+  }
+
+  // a page first touched by a read and then written by the
+  // kernel, here by read() from a pipe, must be written back.
+  int fds[2];
+  fd = open("mmapfile", O_RDWR);
+  p = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(fd < 0 || p == (char*)-1 || pipe(fds) < 0){
+    printf("%s: mmap for read() failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(p[0] != 'X' || write(fds[1], "pq", 2) != 2 || read(fds[0], p, 2) != 2){
+    printf("%s: read() into mapping failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  munmap(p, PGSIZE);
+  fd = open("mmapfile", O_RDONLY);
+  if(read(fd, b, 2) != 2 || b[0] != 'p' || b[1] != 'q'){
+    printf("%s: read() into mapping didn't reach the file\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // a PROT_WRITE-only mapping can be written, and read too,
+  // since the hardware has no write-only pages.
+  fd = open("mmapfile", O_RDWR);
+  p = mmap(0, PGSIZE, PROT_WRITE, MAP_SHARED, fd, 0);
+  if(fd < 0 || p == (char*)-1){
+    printf("%s: mmap PROT_WRITE failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  p[2] = 'w';
+  if(p[0] != 'p' || p[2] != 'w'){
+    printf("%s: bad data in PROT_WRITE mapping\n", s);
+    exit(1);
+  }
+  munmap(p, PGSIZE);
+  fd = open("mmapfile", O_RDONLY);
+  if(read(fd, b, 3) != 3 || b[2] != 'w'){
+    printf("%s: PROT_WRITE mapping didn't reach the file\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("mmapfile");
+}
+
+// msleep() sleeps for at least as long as asked, and
+// sleepers with earlier deadlines wake first.
+void
+msleeptest(char *s)
+{
+  int t0, t1, fds[2];
+  char buf[2];
+
+  if(msleep(0) != 0 || msleep(-1) != 0){
+    printf("%s: msleep of nothing failed\n", s);
+    exit(1);
+  }
+
+  // any 300ms contains at least two clock ticks.
+  t0 = uptime();
+  if(msleep(300) != 0){
+    printf("%s: msleep failed\n", s);
+    exit(1);
+  }
+  t1 = uptime();
+  if(t1 - t0 < 2){
+    printf("%s: msleep(300) took %d ticks\n", s, t1 - t0);
+    exit(1);
+  }
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < 2; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      // the first child asks first, but for longer.
+      msleep(i == 0 ? 250 : 50);
+      write(fds[1], i == 0 ? "b" : "a", 1);
+      exit(0);
+    }
+    if(i == 0)
+      msleep(10);
+  }
+  close(fds[1]);
+  if(read(fds[0], &buf[0], 1) != 1 || read(fds[0], &buf[1], 1) != 1){
+    printf("%s: read failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  wait(0);
+  wait(0);
+  if(buf[0] != 'a' || buf[1] != 'b'){
+    printf("%s: sleepers woke out of order\n", s);
+    exit(1);
+  }
+}
+
 // More file system tests
 
 // two processes write to the same file descriptor
@@ -1479,6 +2083,81 @@ bigdir(char *s)
   }
 }
 
+// a directory that outgrows one block becomes hashed; its
+// entries must all still be found, listed, and removable.
+void
+hashdir(char *s)
+{
+  enum { N = 300 };
+  struct dirent de;
+  int i, fd, n;
+  char name[10];
+
+  if(mkdir("hd") != 0){
+    printf("%s: mkdir hd failed\n", s);
+    exit(1);
+  }
+  fd = open("hd/f", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create hd/f failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  memmove(name, "hd/", 3);
+  for(i = 0; i < N; i++){
+    name[3] = 'a' + i / 26 % 26;
+    name[4] = 'a' + i % 26;
+    name[5] = '0' + i / 676;
+    name[6] = '\0';
+    if(link("hd/f", name) != 0){
+      printf("%s: link(hd/f, %s) failed\n", s, name);
+      exit(1);
+    }
+  }
+
+  // ".", "..", f, and the links.
+  fd = open("hd", O_RDONLY);
+  n = 0;
+  while(read(fd, &de, sizeof(de)) == sizeof(de)){
+    if(de.inum != 0)
+      n++;
+  }
+  close(fd);
+  if(n != N + 3){
+    printf("%s: read %d entries of hd, not %d\n", s, n, N + 3);
+    exit(1);
+  }
+
+  if(unlink("hd/f") != 0 || unlink("hd") == 0){
+    printf("%s: unlink hd/f failed, or of full hd succeeded\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    name[3] = 'a' + i / 26 % 26;
+    name[4] = 'a' + i % 26;
+    name[5] = '0' + i / 676;
+    name[6] = '\0';
+    if((fd = open(name, O_RDONLY)) < 0){
+      printf("%s: open %s failed\n", s, name);
+      exit(1);
+    }
+    close(fd);
+    if(unlink(name) != 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+    if(open(name, O_RDONLY) >= 0){
+      printf("%s: opened %s after unlink\n", s, name);
+      exit(1);
+    }
+  }
+  if(unlink("hd") != 0){
+    printf("%s: unlink empty hd failed\n", s);
+    exit(1);
+  }
+}
+
 void
 subdir(char *s)
 {
@@ -1783,6 +2462,80 @@ fourteen(char *s)
   unlink("12345678901234");
 }
 
+// lookups see names made and removed by mkdir, link and
+// unlink right away, also after a failed lookup of the same
+// name. The second round makes dcd again, likely with the
+// same i-node number, but in another directory, so its ".."
+// differs.
+void
+dcachetest(char *s)
+{
+  struct stat st, pst;
+  int fd, round;
+
+  if(mkdir("dcp") != 0){
+    printf("%s: mkdir dcp failed\n", s);
+    exit(1);
+  }
+  for(round = 0; round < 2; round++){
+    if(round == 1 && chdir("dcp") != 0){
+      printf("%s: chdir dcp failed\n", s);
+      exit(1);
+    }
+    if(mkdir("dcd") != 0){
+      printf("%s: mkdir dcd failed\n", s);
+      exit(1);
+    }
+    if(stat("dcd/..", &st) != 0 || stat(".", &pst) != 0 || st.ino != pst.ino){
+      printf("%s: dcd/.. is not its parent\n", s);
+      exit(1);
+    }
+    if(open("dcd/x", O_RDONLY) >= 0 || open("dcd/y", O_RDONLY) >= 0){
+      printf("%s: opened a name not yet made\n", s);
+      exit(1);
+    }
+    if((fd = open("dcd/x", O_CREATE|O_RDWR)) < 0){
+      printf("%s: create dcd/x failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if((fd = open("dcd/x", O_RDONLY)) < 0){
+      printf("%s: open dcd/x failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if(link("dcd/x", "dcd/y") != 0){
+      printf("%s: link dcd/x dcd/y failed\n", s);
+      exit(1);
+    }
+    if(unlink("dcd/x") != 0){
+      printf("%s: unlink dcd/x failed\n", s);
+      exit(1);
+    }
+    if(open("dcd/x", O_RDONLY) >= 0){
+      printf("%s: opened dcd/x after unlink\n", s);
+      exit(1);
+    }
+    if((fd = open("dcd/y", O_RDONLY)) < 0){
+      printf("%s: open dcd/y failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if(unlink("dcd/y") != 0 || unlink("dcd") != 0){
+      printf("%s: unlink dcd failed\n", s);
+      exit(1);
+    }
+    if(open("dcd/y", O_RDONLY) >= 0){
+      printf("%s: opened dcd/y after unlink\n", s);
+      exit(1);
+    }
+  }
+  if(chdir("..") != 0 || unlink("dcp") != 0){
+    printf("%s: unlink dcp failed\n", s);
+    exit(1);
+  }
+}
+
 void
 rmdot(char *s)
 {
@@ -2666,6 +3419,7 @@ main(int argc, char *argv[])
     {fourfiles, "fourfiles"},
     {sharedfd, "sharedfd"},
     {exectest, "exectest"},
+    {execshare, "execshare"},
     {bigargtest, "bigargtest"},
     {bigwrite, "bigwrite"},
     {bsstest, "bsstest"},
@@ -2679,20 +3433,30 @@ main(int argc, char *argv[])
     {opentest, "opentest"},
     {writetest, "writetest"},
     {writebig, "writebig"},
+    {extentfrag, "extentfrag"},
     {createtest, "createtest"},
     {openiputtest, "openiput"},
     {exitiputtest, "exitiput"},
     {iputtest, "iput"},
     {mem, "mem"},
+    {cowfork, "cowfork"},
+    {lazyalloc, "lazyalloc"},
+    {megaheap, "megaheap"},
+    {buddystat, "buddystat"},
+    {mmapfile, "mmapfile"},
+    {msleeptest, "msleeptest"},
     {pipe1, "pipe1"},
+    {pipebig, "pipebig"},
     {preempt, "preempt"},
     {exitwait, "exitwait"},
+    {dcachetest, "dcache"},
     {rmdot, "rmdot"},
     {fourteen, "fourteen"},
     {bigfile, "bigfile"},
     {dirfile, "dirfile"},
     {iref, "iref"},
     {forktest, "forktest"},
+    {hashdir, "hashdir"},
     {bigdir, "bigdir"}, // slow
     { 0, 0},
   };
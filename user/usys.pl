@@ -14,16 +14,30 @@ sub entry {
     print " ecall\n";
     print " ret\n";
 }
+
+# a syscall that printf.c wraps, to flush buffered output
+# first. the stub is also _name, for the wrapper to call;
+# programs linked without printf.o get the stub as name.
+sub wrapped {
+    my $name = shift;
+    print ".global _$name\n";
+    print ".weak $name\n";
+    print "_${name}:\n";
+    print "${name}:\n";
+    print " li a7, SYS_${name}\n";
+    print " ecall\n";
+    print " ret\n";
+}
 	
-entry("fork");
-entry("exit");
+wrapped("fork");
+wrapped("exit");
 entry("wait");
 entry("pipe");
 entry("read");
 entry("write");
-entry("close");
+wrapped("close");
 entry("kill");
-entry("exec");
+wrapped("exec");
 entry("open");
 entry("mknod");
 entry("unlink");
@@ -36,3 +50,8 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("mmap");
+entry("munmap");
+entry("msleep");
+entry("splice");
+entry("memstat");